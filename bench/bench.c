@@ -0,0 +1,306 @@
+/*
+ *  Domain_check:
+ *  Headless harness that drives the plugin through the GKrellM stand in
+ *  of gkrellm_mock.c and reports what each phase costs.
+ *
+ *  domain_check.c is included rather than linked, so that the harness
+ *  can call the expose handler and set the list modified flag like the
+ *  config tab buttons do.  For each number of domains given (10, 100,
+ *  1000 and 10000 by default) a child process loads that many domains
+ *  and runs the phases GKrellM would:
+ *
+ *    load      load_plugin_config() for each domain line
+ *    create    create_plugin() on first create
+ *    update    update_plugin() on an hour tick, starting the lookups
+ *    status    show_status() of every domain, as a finished run does
+ *    expose    one expose event for every panel
+ *    tab       create_plugin_tab()
+ *    apply     apply_plugin_config() with the domain list modified
+ *    recreate  create_plugin() after a theme change
+ *    save      save_plugin_config()
+ *    disable   disable_plugin()
+ *    reload    load_plugin_config() for each line saved, with the
+ *              domains read from the binary copy
+ *
+ *  and prints the time, the allocations and the GKrellM calls of each.
+ *  No display is needed, the widgets are never realized.  Nothing leaves
+ *  the host: the lookups the update phase starts go to BENCH_NAMESERVER,
+ *  a loopback address nothing listens on, instead of the nameservers of
+ *  resolv.conf, the external ip address is taken as just fetched so
+ *  OpenDNS isn't asked, and the gateway isn't used.  The main loop is
+ *  never run so no lookup completes.
+ *
+ *  Allocations are counted by wrapping malloc() of glibc, which GLib
+ *  and GTK allocate with too.
+ *
+ *  Copyright (C) 2016 Tommy Skagemo-Andreassen
+ *
+ *  This program is free software which I release under the GNU General Public
+ *  License. You may redistribute and/or modify this program under the terms
+ *  of that license as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "gkrellm_mock.h"
+#include <sys/wait.h>
+
+#undef gdk_draw_pixmap
+#define gdk_draw_pixmap mock_draw_pixmap
+
+#include "../domain_check.c"
+
+#define BENCH_DIR "domain_check_bench"
+#define BENCH_NAMESERVER "127.0.0.254"
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *p, size_t size);
+extern void __libc_free (void *p);
+
+static guint64 allocCalls;
+static guint64 allocBytes;
+static guint64 freeCalls;
+static guint64 logWarnings;
+
+static struct
+{
+  const gchar *name;
+  gint64      started;
+  guint64     allocs;
+  guint64     bytes;
+  guint64     frees;
+  guint64     warnings;
+} phase;
+
+
+void *malloc (size_t size)
+{
+  allocCalls += 1;
+  allocBytes += size;
+  return __libc_malloc (size);
+}
+
+void *calloc (size_t n, size_t size)
+{
+  allocCalls += 1;
+  allocBytes += n * size;
+  return __libc_calloc (n, size);
+}
+
+void *realloc (void *p, size_t size)
+{
+  allocCalls += 1;
+  allocBytes += size;
+  return __libc_realloc (p, size);
+}
+
+void free (void *p)
+{
+  if (p)
+    freeCalls += 1;
+  __libc_free (p);
+}
+
+/*
+ * Without a display GTK complains about widgets it can't style, count
+ * that instead of printing it.
+ */
+static void log_handler (const gchar *log_domain, GLogLevelFlags level,
+                         const gchar *message, gpointer data)
+{
+  logWarnings += 1;
+}
+
+static void phase_begin (const gchar *name)
+{
+  mock_reset ();
+  phase.name = name;
+  phase.allocs = allocCalls;
+  phase.bytes = allocBytes;
+  phase.frees = freeCalls;
+  phase.warnings = logWarnings;
+  phase.started = g_get_monotonic_time ();
+}
+
+static void phase_end (gint n)
+{
+  gint64 elapsed;
+
+  elapsed = g_get_monotonic_time () - phase.started;
+  printf ("  %-8s %10.3f ms %9.2f us/domain %10" G_GUINT64_FORMAT " allocs"
+          " %12" G_GUINT64_FORMAT " bytes %10" G_GUINT64_FORMAT " frees"
+          " %6" G_GUINT64_FORMAT " warnings\n",
+          phase.name, elapsed / 1000.0, (gdouble) elapsed / MAX (n, 1),
+          allocCalls - phase.allocs, allocBytes - phase.bytes,
+          freeCalls - phase.frees, logWarnings - phase.warnings);
+  mock_report (stdout, n);
+}
+
+static void run (gint n)
+{
+  GkrellmMonitor *mon;
+  GtkWidget      *vbox;
+  GtkWidget      *tab_vbox;
+  GdkEventExpose ev;
+  GDomain        *domain;
+  GList          *list;
+  gchar          **lines;
+  gchar          *saved = NULL;
+  gsize          saved_len = 0;
+  FILE           *f;
+  gint           i;
+
+  printf ("%d domains\n", n);
+  mon = gkrellm_init_plugin ();
+  resolver_set_servers (BENCH_NAMESERVER);
+  gatewayEnabled = 0;
+  gatewayAnnounce = 0;
+  vbox = gtk_vbox_new (FALSE, 0);
+  tab_vbox = gtk_vbox_new (FALSE, 0);
+
+  lines = g_new0 (gchar *, n + 1);
+  for (i = 0; i < n; i += 1)
+    lines[i] = g_strdup_printf ("enabled=1 domain=d%d.bench.invalid", i);
+
+  phase_begin ("load");
+  for (i = 0; i < n; i += 1)
+    mon->load_user_config (lines[i]);
+  phase_end (n);
+  g_strfreev (lines);
+
+  phase_begin ("create");
+  mon->create_monitor (vbox, TRUE);
+  phase_end (n);
+
+  inet_aton ("192.0.2.1", &externalAddr);
+  externalFetched = time (NULL);
+  phase_begin ("update");
+  GK.hour_tick = 1;
+  mon->update_monitor ();
+  GK.hour_tick = 0;
+  phase_end (n);
+
+  phase_begin ("status");
+  for (list = domainList; list; list = list->next)
+    show_status ((GDomain *) list->data);
+  phase_end (n);
+
+  memset (&ev, 0, sizeof (ev));
+  ev.area.width = MOCK_CHART_WIDTH;
+  ev.area.height = 1;
+  phase_begin ("expose");
+  for (list = domainList; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    panel_expose_event (domain->panel->drawing_area, &ev);
+  }
+  phase_end (n);
+
+  phase_begin ("tab");
+  mon->create_config (tab_vbox);
+  phase_end (n);
+
+  phase_begin ("apply");
+  listModified = TRUE;
+  mon->apply_config ();
+  phase_end (n);
+
+  phase_begin ("recreate");
+  mon->create_monitor (vbox, FALSE);
+  phase_end (n);
+
+  phase_begin ("save");
+  f = open_memstream (&saved, &saved_len);
+  if (f)
+  {
+    mon->save_user_config (f);
+    fclose (f);
+  }
+  phase_end (n);
+
+  phase_begin ("disable");
+  disable_plugin ();
+  phase_end (n);
+
+  /*
+   * Start over from no domains, and give the saved lines back without
+   * the keyword like GKrellM does.
+   */
+  while (domainList)
+  {
+    free_domain ((GDomain *) domainList->data);
+    domainList = g_list_delete_link (domainList, domainList);
+  }
+  configCacheLoaded = FALSE;
+  lines = g_strsplit (saved ? saved : "", "\n", 0);
+  for (i = 0; lines[i]; i += 1)
+    if (g_str_has_prefix (lines[i], PLUGIN_CONFIG_KEYWORD " "))
+      memmove (lines[i], lines[i] + strlen (PLUGIN_CONFIG_KEYWORD " "),
+               strlen (lines[i]) - strlen (PLUGIN_CONFIG_KEYWORD " ") + 1);
+
+  phase_begin ("reload");
+  for (i = 0; lines[i]; i += 1)
+    if (*lines[i])
+      mon->load_user_config (lines[i]);
+  phase_end (n);
+
+  if (g_list_length (domainList) != (guint) n)
+    printf ("  reload got %u domains\n", g_list_length (domainList));
+  g_strfreev (lines);
+  free (saved);
+}
+
+int main (int argc, char **argv)
+{
+  gint  sizes[] = { 10, 100, 1000, 10000 };
+  gint  i;
+  gint  n;
+  gint  status;
+  gchar *dir;
+  pid_t pid;
+
+  dir = g_build_filename (g_get_tmp_dir (), BENCH_DIR, NULL);
+  mock_init (dir);
+  g_free (dir);
+
+  for (i = 0; i < (argc > 1 ? argc - 1 : (gint) G_N_ELEMENTS (sizes)); i += 1)
+  {
+    n = argc > 1 ? atoi (argv[i + 1]) : sizes[i];
+    if (n <= 0)
+      continue;
+
+    /*
+     * A child for each size, so that each starts from a fresh plugin.
+     */
+    fflush (stdout);
+    pid = fork ();
+    if (pid == 0)
+    {
+      gtk_init_check (&argc, &argv);
+      g_log_set_handler (NULL, G_LOG_LEVEL_WARNING | G_LOG_LEVEL_CRITICAL,
+                         log_handler, NULL);
+      g_log_set_handler ("Gtk", G_LOG_LEVEL_WARNING | G_LOG_LEVEL_CRITICAL,
+                         log_handler, NULL);
+      g_log_set_handler ("Gdk", G_LOG_LEVEL_WARNING | G_LOG_LEVEL_CRITICAL,
+                         log_handler, NULL);
+      g_log_set_handler ("GLib-GObject",
+                         G_LOG_LEVEL_WARNING | G_LOG_LEVEL_CRITICAL,
+                         log_handler, NULL);
+      run (n);
+      fflush (stdout);
+      _exit (0);
+    }
+    if (pid < 0 || waitpid (pid, &status, 0) < 0
+        || !WIFEXITED (status) || WEXITSTATUS (status))
+    {
+      fprintf (stderr, "%d domains: harness failed\n", n);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,491 @@
+/*
+ *  Domain_check:
+ *  Stand in for the parts of the GKrellM API the plugin uses.
+ *
+ *  Every function counts its calls.  Panels, decals, buttons and charts
+ *  are allocated and freed the way GKrellM does, and a panel keeps its
+ *  decals in a list that gkrellm_draw_panel_layers() walks, so that the
+ *  allocations and the work per call are in proportion to the real ones.
+ *  Nothing is drawn.  Widgets the plugin reads back, like the spin
+ *  buttons and entries of the config tab, are real GTK widgets.
+ *
+ *  Copyright (C) 2016 Tommy Skagemo-Andreassen
+ *
+ *  This program is free software which I release under the GNU General Public
+ *  License. You may redistribute and/or modify this program under the terms
+ *  of that license as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "gkrellm_mock.h"
+#include <string.h>
+#include <sys/stat.h>
+
+#define MOCK_DECAL_HEIGHT 12
+
+typedef struct _MockCounter
+{
+  const gchar         *name;
+  guint64             calls;
+  gboolean            registered;
+  struct _MockCounter *next;
+} MockCounter;
+
+/*
+ * Each function has a static counter, put at the end of the list on its
+ * first call so that the report is in the order of the first calls.
+ */
+#define MOCK_COUNT() \
+  static MockCounter counter = { G_STRFUNC }; \
+  mock_count (&counter)
+
+GkrellmTicks GK;
+
+static MockCounter *counters;
+static MockCounter **countersTail = &counters;
+static gchar *dataDir;
+
+/*
+ * Decals and buttons of each panel, freed with the panel.
+ */
+static GHashTable *panelDecals;
+static GHashTable *panelButtons;
+
+static GkrellmStyle meterStyle;
+static GkrellmTextstyle meterTextstyle;
+static GkrellmMargin margins = { 1, 1, 1, 1 };
+
+
+static void mock_count (MockCounter *counter)
+{
+  if (!counter->registered)
+  {
+    counter->registered = TRUE;
+    *countersTail = counter;
+    countersTail = &counter->next;
+  }
+  counter->calls += 1;
+}
+
+void mock_init (const gchar *dir)
+{
+  dataDir = g_strdup (dir);
+  panelDecals = g_hash_table_new (g_direct_hash, g_direct_equal);
+  panelButtons = g_hash_table_new (g_direct_hash, g_direct_equal);
+}
+
+void mock_reset ()
+{
+  MockCounter *counter;
+
+  for (counter = counters; counter; counter = counter->next)
+    counter->calls = 0;
+}
+
+void mock_report (FILE *f, gint n_domains)
+{
+  MockCounter *counter;
+
+  for (counter = counters; counter; counter = counter->next)
+  {
+    if (counter->calls == 0)
+      continue;
+    fprintf (f, "    %-42s %10" G_GUINT64_FORMAT " %10.2f/domain\n",
+             counter->name, counter->calls,
+             (gdouble) counter->calls / MAX (n_domains, 1));
+  }
+}
+
+void mock_draw_pixmap (GdkWindow *window, GdkGC *gc, GdkPixmap *pixmap,
+                       gint xsrc, gint ysrc, gint xdest, gint ydest,
+                       gint width, gint height)
+{
+  MOCK_COUNT ();
+}
+
+/*
+ * Styles and themes.
+ */
+gint gkrellm_add_meter_style (GkrellmMonitor *mon, gchar *name)
+{
+  MOCK_COUNT ();
+  return 0;
+}
+
+GkrellmStyle *gkrellm_meter_style (gint style_id)
+{
+  MOCK_COUNT ();
+  return &meterStyle;
+}
+
+GkrellmTextstyle *gkrellm_meter_alt_textstyle (gint style_id)
+{
+  MOCK_COUNT ();
+  return &meterTextstyle;
+}
+
+GkrellmMargin *gkrellm_get_style_margins (GkrellmStyle *style)
+{
+  MOCK_COUNT ();
+  return &margins;
+}
+
+GdkPixmap *gkrellm_decal_misc_pixmap ()
+{
+  MOCK_COUNT ();
+  return NULL;
+}
+
+GdkBitmap *gkrellm_decal_misc_mask ()
+{
+  MOCK_COUNT ();
+  return NULL;
+}
+
+gint gkrellm_chart_width ()
+{
+  MOCK_COUNT ();
+  return MOCK_CHART_WIDTH;
+}
+
+/*
+ * Panels, decals and buttons.
+ */
+GkrellmPanel *gkrellm_panel_new0 ()
+{
+  MOCK_COUNT ();
+  return g_new0 (GkrellmPanel, 1);
+}
+
+void gkrellm_panel_configure (GkrellmPanel *p, gchar *string,
+                              GkrellmStyle *style)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_panel_create (GtkWidget *box, GkrellmMonitor *mon,
+                           GkrellmPanel *p)
+{
+  MOCK_COUNT ();
+  if (p->drawing_area)
+    return;
+  p->drawing_area = gtk_drawing_area_new ();
+  gtk_box_pack_start (GTK_BOX (box), p->drawing_area, FALSE, FALSE, 0);
+  gtk_widget_show (p->drawing_area);
+}
+
+void gkrellm_panel_destroy (GkrellmPanel *p)
+{
+  GList *list;
+
+  MOCK_COUNT ();
+  list = g_hash_table_lookup (panelDecals, p);
+  g_list_foreach (list, (GFunc) g_free, NULL);
+  g_list_free (list);
+  list = g_hash_table_lookup (panelButtons, p);
+  g_list_foreach (list, (GFunc) g_free, NULL);
+  g_list_free (list);
+  g_hash_table_remove (panelDecals, p);
+  g_hash_table_remove (panelButtons, p);
+  if (p->drawing_area)
+    gtk_widget_destroy (p->drawing_area);
+  g_free (p);
+}
+
+void gkrellm_panel_show (GkrellmPanel *p)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_panel_hide (GkrellmPanel *p)
+{
+  MOCK_COUNT ();
+}
+
+static GkrellmDecal *new_decal (GkrellmPanel *p, gint x, gint y, gint w)
+{
+  GkrellmDecal *d;
+
+  d = g_new0 (GkrellmDecal, 1);
+  d->x = MAX (x, 0);
+  d->y = MAX (y, 0);
+  d->w = w;
+  d->h = MOCK_DECAL_HEIGHT;
+  g_hash_table_insert (panelDecals, p,
+                       g_list_append (g_hash_table_lookup (panelDecals, p), d));
+  return d;
+}
+
+GkrellmDecal *gkrellm_create_decal_pixmap (GkrellmPanel *p, GdkPixmap *pixmap,
+                                           GdkBitmap *mask, gint depth,
+                                           GkrellmStyle *style, gint x, gint y)
+{
+  MOCK_COUNT ();
+  return new_decal (p, x, y, MOCK_DECAL_HEIGHT);
+}
+
+GkrellmDecal *gkrellm_create_decal_text (GkrellmPanel *p, gchar *string,
+                                         GkrellmTextstyle *ts,
+                                         GkrellmStyle *style,
+                                         gint x, gint y, gint w)
+{
+  MOCK_COUNT ();
+  return new_decal (p, x, y, w);
+}
+
+void gkrellm_draw_decal_text (GkrellmPanel *p, GkrellmDecal *d, gchar *s,
+                              gint value)
+{
+  MOCK_COUNT ();
+}
+
+GkrellmDecalbutton *gkrellm_make_decal_button (GkrellmPanel *p, GkrellmDecal *d,
+                                               void (*func) (), void *data,
+                                               gint up_index, gint down_index)
+{
+  GkrellmDecalbutton *b;
+
+  MOCK_COUNT ();
+  b = g_new0 (GkrellmDecalbutton, 1);
+  b->panel = p;
+  b->decal = d;
+  g_hash_table_insert (panelButtons, p,
+                       g_list_append (g_hash_table_lookup (panelButtons, p), b));
+  return b;
+}
+
+void gkrellm_set_decal_button_index (GkrellmDecalbutton *b, gint index)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_draw_panel_layers (GkrellmPanel *p)
+{
+  GList *list;
+  gint  n = 0;
+
+  MOCK_COUNT ();
+  for (list = g_hash_table_lookup (panelDecals, p); list; list = list->next)
+    n += 1;
+}
+
+/*
+ * Charts.
+ */
+GkrellmChart *gkrellm_chart_new0 ()
+{
+  MOCK_COUNT ();
+  return g_new0 (GkrellmChart, 1);
+}
+
+void gkrellm_chart_create (GtkWidget *box, GkrellmMonitor *mon,
+                           GkrellmChart *cp, GkrellmChartconfig **cf)
+{
+  MOCK_COUNT ();
+  if (!*cf)
+    *cf = g_new0 (GkrellmChartconfig, 1);
+  if (cp->drawing_area)
+    return;
+  cp->drawing_area = gtk_drawing_area_new ();
+  gtk_box_pack_start (GTK_BOX (box), cp->drawing_area, FALSE, FALSE, 0);
+}
+
+void gkrellm_chart_show (GkrellmChart *cp, gboolean show_panel)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_chart_hide (GkrellmChart *cp, gboolean hide_panel)
+{
+  MOCK_COUNT ();
+}
+
+GkrellmChartdata *gkrellm_add_default_chartdata (GkrellmChart *cp, gchar *label)
+{
+  MOCK_COUNT ();
+  return g_new0 (GkrellmChartdata, 1);
+}
+
+void gkrellm_monotonic_chartdata (GkrellmChartdata *cd, gboolean value)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_set_chartdata_draw_style_default (GkrellmChartdata *cd, gint dflt)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_alloc_chartdata (GkrellmChart *cp)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_store_chartdata (GkrellmChart *cp, gulong total, ...)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_draw_chartdata (GkrellmChart *cp)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_draw_chart_to_screen (GkrellmChart *cp)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_refresh_chart (GkrellmChart *cp)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_save_chartconfig (FILE *f, GkrellmChartconfig *cf,
+                               gchar *mon_keyword, gchar *name)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_load_chartconfig (GkrellmChartconfig **cf, gchar *config_line,
+                               gint max_cd)
+{
+  MOCK_COUNT ();
+  if (!*cf)
+    *cf = g_new0 (GkrellmChartconfig, 1);
+}
+
+/*
+ * Config tab widgets.
+ */
+GtkWidget *gkrellm_gtk_notebook_page (GtkWidget *tabs, gchar *name)
+{
+  GtkWidget *vbox;
+
+  MOCK_COUNT ();
+  vbox = gtk_vbox_new (FALSE, 0);
+  gtk_notebook_append_page (GTK_NOTEBOOK (tabs), vbox, gtk_label_new (name));
+  return vbox;
+}
+
+GtkWidget *gkrellm_gtk_scrolled_vbox (GtkWidget *box, GtkWidget **scr,
+                                      GtkPolicyType h_policy,
+                                      GtkPolicyType v_policy)
+{
+  GtkWidget *vbox;
+
+  MOCK_COUNT ();
+  vbox = gtk_vbox_new (FALSE, 0);
+  gtk_box_pack_start (GTK_BOX (box), vbox, TRUE, TRUE, 0);
+  if (scr)
+    *scr = vbox;
+  return vbox;
+}
+
+GtkWidget *gkrellm_gtk_scrolled_text_view (GtkWidget *box, GtkWidget **scr,
+                                           GtkPolicyType h_policy,
+                                           GtkPolicyType v_policy)
+{
+  GtkWidget *text;
+
+  MOCK_COUNT ();
+  text = gtk_text_view_new ();
+  gtk_box_pack_start (GTK_BOX (box), text, TRUE, TRUE, 0);
+  if (scr)
+    *scr = text;
+  return text;
+}
+
+void gkrellm_gtk_text_view_append_strings (GtkWidget *text, gchar **string,
+                                           gint n_strings)
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_gtk_spin_button (GtkWidget *box, GtkWidget **spin_button,
+                              gfloat value, gfloat low, gfloat high,
+                              gfloat step0, gfloat step1, gint digits,
+                              gint width, void (*cb_func) (), gpointer data,
+                              gboolean right_align, gchar *string)
+{
+  GtkWidget *spin;
+
+  MOCK_COUNT ();
+  spin = gtk_spin_button_new_with_range (low, high, step0);
+  gtk_spin_button_set_value (GTK_SPIN_BUTTON (spin), value);
+  gtk_box_pack_start (GTK_BOX (box), spin, FALSE, FALSE, 0);
+  if (spin_button)
+    *spin_button = spin;
+}
+
+gchar *gkrellm_gtk_entry_get_text (GtkWidget **entry)
+{
+  MOCK_COUNT ();
+  return (gchar *) gtk_entry_get_text (GTK_ENTRY (*entry));
+}
+
+/*
+ * Everything else.
+ */
+gboolean gkrellm_dup_string (gchar **dst, gchar *src)
+{
+  MOCK_COUNT ();
+  if (!src)
+    src = "";
+  if (*dst && !strcmp (*dst, src))
+    return FALSE;
+  g_free (*dst);
+  *dst = g_strdup (src);
+  return TRUE;
+}
+
+gchar *gkrellm_make_data_file_name (gchar *subdir, gchar *name)
+{
+  gchar *dir;
+  gchar *path;
+
+  MOCK_COUNT ();
+  dir = g_build_filename (dataDir, subdir, NULL);
+  g_mkdir_with_parents (dir, 0755);
+  path = g_build_filename (dir, name, NULL);
+  g_free (dir);
+  return path;
+}
+
+void gkrellm_disable_plugin_connect (GkrellmMonitor *mon, void (*cb_func) ())
+{
+  MOCK_COUNT ();
+}
+
+/*
+ * Never connected to a gkrellmd.
+ */
+gboolean gkrellm_client_mode ()
+{
+  MOCK_COUNT ();
+  return FALSE;
+}
+
+void gkrellm_client_plugin_get_setup (gchar *key_name,
+                                      void (*setup_func_cb) (gchar *str))
+{
+  MOCK_COUNT ();
+}
+
+void gkrellm_client_plugin_serve_data_connect (GkrellmMonitor *mon,
+                                               gchar *key_name,
+                                               void (*func_cb) (gchar *line))
+{
+  MOCK_COUNT ();
+}
+
+gboolean gkrellm_client_send_to_server (gchar *key_name, gchar *line)
+{
+  MOCK_COUNT ();
+  return FALSE;
+}
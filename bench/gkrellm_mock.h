@@ -0,0 +1,50 @@
+/*
+ *  Domain_check:
+ *  Stand in for the parts of the GKrellM API the plugin uses, so that the
+ *  plugin can be driven without GKrellM or a display.
+ *
+ *  Copyright (C) 2016 Tommy Skagemo-Andreassen
+ *
+ *  This program is free software which I release under the GNU General Public
+ *  License. You may redistribute and/or modify this program under the terms
+ *  of that license as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef GKRELLM_MOCK_H
+#define GKRELLM_MOCK_H
+
+#include <gkrellm2/gkrellm.h>
+
+#define MOCK_CHART_WIDTH 100
+
+/*
+ * Data files go under dir instead of ~/.gkrellm2/data.
+ */
+void mock_init (const gchar *dir);
+
+/*
+ * Zero the call counters, done at the start of each phase.
+ */
+void mock_reset (void);
+
+/*
+ * Print the functions called since mock_reset(), with the number of
+ * calls and calls per domain.
+ */
+void mock_report (FILE *f, gint n_domains);
+
+/*
+ * Used for gdk_draw_pixmap() in the expose handler, the panels are never
+ * realized so there is nothing to draw to.
+ */
+void mock_draw_pixmap (GdkWindow *window, GdkGC *gc, GdkPixmap *pixmap,
+                       gint xsrc, gint ysrc, gint xdest, gint ydest,
+                       gint width, gint height);
+
+#endif
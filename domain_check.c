@@ -6,8 +6,10 @@
  *	the account at my domain provider when the ip address change.
  * 	So this plugin monitors the sub domains and check if they have the correct address.
  *  
- *  I use the "host" command suggested by this site to fetch my external ip address:
+ *  I fetch my external ip address with the same lookup as the "host" command
+ *  suggested by this site, myip.opendns.com at resolver1.opendns.com:
  *  http://www.dokws.com/questions/question/find-internal-external-ip-address-linux-command-line/
+ *  The lookups are done by resolver.c without blocking GKrellM.
  *
  *  Output of debug requires that plugin is called with:
  *  gkrellm -l <logfilename> -d 0x20000 &
@@ -38,12 +40,22 @@
  */
 
 #include <gkrellm2/gkrellm.h>
-#include <netdb.h>
+#include "domain_check.h"
+#include "resolver.h"
+#include "gateway.h"
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
 
 /*
  * Make sure we have a compatible version of GKrellM
@@ -53,14 +65,25 @@
 #error This plugin requires GKrellM version >= 2
 #endif
 
-#define CONFIG_NAME "DomainCheck"
-
 #define PLUGIN_PLACEMENT (MON_UPTIME | MON_INSERT_AFTER)
 
-#define PLUGIN_CONFIG_KEYWORD "domaincheck"
-
 #define STYLE_NAME "GKrellMDomainCheck"
 
+/*
+ * Files kept under ~/.gkrellm2/data/domain_check/
+ * History of check results is kept in a ring of fixed size records.
+ */
+#define DATA_DIR "domain_check"
+#define HISTORY_FILE "history"
+#define CONTROL_FILE "control"
+#define HISTORY_MAGIC 0x32484344
+#define HISTORY_RECORDS_DEFAULT 65536
+#define CONFIG_CACHE_FILE "domains"
+#define CONFIG_CACHE_MAGIC 0x31434344
+#define CONFIG_CACHE_VERSION 1
+
+#define STATS_MAX_UPSTREAMS 16
+
 
 extern GkrellmTicks     GK;
 
@@ -76,7 +99,67 @@ static gchar *GKrellMDomainCheckInfo[] =
   "Use the \"Replace\" button to update changes made for currently selected ",
   "list entry.\n",
   "Use the \"Delete\" button to delete the selected entry.\n",
-  "Use the /\\ & \\/  buttons to move selected entry up & down in position.\n",
+  "Use the /\\ & \\/  buttons to move selected entry up & down in position.\n\n",
+  "The tooltip of a domain panel shows the CNAME chain the domain ",
+  "resolved through and the last status.\n\n",
+  "When GKrellM is connected to a gkrellmd that runs the domain_check ",
+  "server plugin, the domains configured in gkrellmd.conf are checked ",
+  "there once for all clients and shown instead of these.  Pressing the ",
+  "LED asks gkrellmd to check the domain.\n\n",
+  "<b>Options\n\n",
+  "Log check history: ",
+  "Append every check result to a ring file in ~/.gkrellm2/data/domain_check/.\n",
+  "History records: ",
+  "Size of the ring, the oldest records are overwritten when it is full.\n",
+  "Show history chart: ",
+  "Chart average resolve latency and number of mismatches for each hourly check.\n",
+  "Lookup timeout: ",
+  "Give up on a lookup after this many ms, it is sent again to another ",
+  "nameserver halfway through.  Lookups go to the nameserver that has ",
+  "answered fastest lately, one that keeps timing out is left alone for ",
+  "a while.  STATS shows the round trip time of each.\n",
+  "Check cycle deadline: ",
+  "Lookups still pending this many seconds after a check started are ",
+  "cancelled and the domains marked as timed out.\n",
+  "Nameserver in-flight limit: ",
+  "At most this many lookups wait for an answer from each nameserver, ",
+  "the rest are queued.  Queued lookups are sent by turns per zone, so ",
+  "many domains under one zone don't hold up the others.\n",
+  "Nameserver rate / burst: ",
+  "Send at most this many lookups per second to each nameserver, with ",
+  "bursts of up to the burst size.\n",
+  "TCP connections per nameserver: ",
+  "0 sends each lookup in its own UDP packet.  Otherwise lookups are ",
+  "pipelined over up to this many TCP connections to each nameserver, ",
+  "which are kept open for the next checks.  Worth it for lists of ",
+  "many thousand domains.\n",
+  "Control socket: ",
+  "Listen on the unix socket ~/.gkrellm2/data/domain_check/control.\n",
+  "One command per line, each answered by data lines and a final OK or ERR line:\n",
+  "  STATUS               status of all domains, with the CNAMEs followed\n",
+  "  CHECK <glob>         check the matching domains, answered when done\n",
+  "  ADD <domain>         add an enabled domain\n",
+  "  DEL <domain>         remove a domain\n",
+  "  STATS                counters, and queue state and round trip time per nameserver\n",
+  "Ask the gateway for the external ip: ",
+  "Get the external ip address from the default gateway over NAT-PMP, ",
+  "without a lookup leaving the local network.  If the gateway doesn't ",
+  "answer, myip.opendns.com is looked up as before.\n",
+  "Listen for gateway announcements: ",
+  "Check all domains straight away when the gateway announces that the ",
+  "external ip address changed.\n",
+  "Gateway address: ",
+  "Ask this address instead of the default gateway, leave empty to use ",
+  "the default route.\n",
+  "Prometheus metrics file: ",
+  "Write check status, counters and latency histograms to this file after ",
+  "each batch of checks, e.g. into the node_exporter textfile directory as ",
+  "domain_check.prom.  Leave empty to disable.\n",
+  "Domain list file: ",
+  "Also check the domains listed in this file, one per line, optionally ",
+  "followed by 0 to disable it.  Lines starting with # are ignored.  ",
+  "The file is reloaded when it changes, only added, removed or changed ",
+  "domains are touched.  These domains are not shown in the Setup tab.\n",
 };
 
 static gchar GKrellMDomainCheckAbout[] = 
@@ -86,10 +169,43 @@ static gchar GKrellMDomainCheckAbout[] =
 
 static GkrellmMonitor *monitor;
 
+/*
+ * Latency histogram, upper bounds of the buckets in ms.
+ * bucket[N_LATENCY_BUCKETS] counts everything slower.
+ */
+static const gint latencyBuckets[] =
+  { 1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000 };
+
+#define N_LATENCY_BUCKETS G_N_ELEMENTS (latencyBuckets)
+
+typedef struct
+{
+  guint64 bucket[N_LATENCY_BUCKETS + 1];
+  guint64 sum_ms;
+  guint64 count;
+} LatencyHistogram;
+
 typedef struct
 {
   gint  enabled;
   gchar *domain;
+  gint  from_file;   /* Read from the domain list file, not saved in config */
+  gint  from_server; /* Checked and served by gkrellmd, not saved in config */
+
+  /* Result of the last check */
+  gint    status;
+  gint    latency_ms;
+  time_t  last_check;
+  guint32 addr;          /* Address the domain resolved to */
+  gchar   *chain;        /* "name -> cname -> ..." if it is a CNAME */
+
+  /* Check in progress */
+  ResolverQuery *query;
+  gboolean      awaiting_external;
+
+  /* Counters since the domain was added, exported as metrics */
+  guint64          checks[N_CHECK_OUTCOMES];
+  LatencyHistogram latency;
 
   /* Each domain has its own Panel & Decal */
   GkrellmPanel *panel; 
@@ -102,244 +218,2647 @@ typedef struct
  * We need a list to hold our series of GDomains.
  */
 static GList *domainList;
+static GList *domainListEnd;    /* Last link, NULL when it has to be looked up */
+
+/*
+ * External ip address fetch counters.
+ */
+static struct
+{
+  LatencyHistogram latency;
+  guint64 cache_hits;
+  guint64 cache_misses;
+  guint64 errors;
+  guint64 from_gateway;
+  guint64 from_dns;
+  guint64 announcements;
+} externalStats;
+
+/*
+ * External domain list file, reloaded when inotify reports it changed.
+ */
+#define DOMAIN_FILE_RELOAD_DELAY 250
+
+static gchar *domainFile;
+static gint inotifyFd = -1;
+static gint inotifyWd = -1;
+static guint inotifyWatch;
+static guint reloadTimeout;
+static gboolean checkNew;
+
+/*
+ * Metrics are written to this file after each batch of checks,
+ * no metrics when empty.
+ */
+static gchar *metricsFile;
+
+/*
+ * State of the current check run.
+ */
+enum
+{
+  EXTERNAL_UNKNOWN = 0,
+  EXTERNAL_PENDING,
+  EXTERNAL_OK,
+  EXTERNAL_FAILED
+};
+
+static gint lookupTimeout = LOOKUP_TIMEOUT_DEFAULT;
+static gint cycleDeadline = CYCLE_DEADLINE_DEFAULT;
+static gint upstreamInFlight = UPSTREAM_IN_FLIGHT_DEFAULT;
+static gint upstreamRate = UPSTREAM_RATE_DEFAULT;
+static gint upstreamBurst = UPSTREAM_BURST_DEFAULT;
+static gint tcpConnections;
+static gboolean runActive;
+static gboolean runCycle;
+static gint runPending;
+static guint runDeadline;
+static gint64 runStarted;
+static ResolverQuery *externalQuery;
+static GatewayQuery *externalGatewayQuery;
+static gint gatewayEnabled;
+static gint gatewayAnnounce;
+static gchar *gatewayAddress;
+static gint externalState;
+static struct in_addr externalAddr;
+static time_t externalFetched;
 
 static gboolean listModified;
 static gboolean force_update;
 
-static gint style_id;
+/*
+ * Connected to a gkrellmd running the server plugin.  The domains it
+ * serves are shown instead of the local ones, and nothing is looked up
+ * here.
+ */
+static gboolean serverMode;
+static gint serverVersion;
+static gboolean serverChecks;   /* Waiting for gkrellmd to finish a run */
+static GHashTable *serverDomains;  /* Name to served GDomain */
+
+static gint style_id;
+
+/*
+ * Binary copy of the domain list, mapped at startup instead of parsing
+ * one config line per domain.  The header is followed by the entries
+ * and then the names, NUL terminated, which the entries point into.
+ * The checksum covers everything after the header and is saved in the
+ * text config too, so a copy that doesn't belong to that config is
+ * never used.  The domain lines stay in the text config for when the
+ * copy is missing or doesn't match, and on load each is compared with
+ * the domain of the copy it was saved from, so that a line edited by
+ * hand wins over the copy.
+ */
+typedef struct
+{
+  guint32 magic;
+  guint32 version;
+  guint32 entry_size;
+  guint32 count;
+  guint32 names_size;
+  guint32 checksum;
+} ConfigCacheHeader;
+
+typedef struct
+{
+  guint32 name;          /* Offset of the name after the entries */
+  guint32 name_len;
+  guint32 enabled;
+} ConfigCacheEntry;
+
+static gboolean configCacheLoaded;
+static GList *configCacheNext;   /* Domain of the copy the next line should match */
+
+/*
+ * Check history.  Records are buffered in historyPending and written
+ * in one batch at the end of each check cycle.  The ring of records is
+ * followed by the names of the domains, NUL terminated, and a record
+ * refers to its domain by the index of the name.  Names are only ever
+ * added, so an index stays valid for as long as the file.
+ */
+typedef struct
+{
+  guint32 magic;
+  guint32 record_size;
+  guint32 capacity;
+  guint32 next;          /* Slot the next record goes into */
+  guint32 names_size;    /* Bytes of names after the ring */
+} HistoryHeader;
+
+typedef struct
+{
+  guint32 time;
+  guint32 domain_id;     /* Index of the domain name */
+  guint32 domain_ip;     /* Network byte order, 0 if not resolved */
+  guint32 external_ip;   /* Network byte order, 0 if not fetched */
+  guint16 latency_ms;
+  guint8  outcome;
+  guint8  flags;
+} HistoryRecord;
+
+#define HISTORY_CYCLE      0x01   /* Checked in a check cycle */
+#define HISTORY_CYCLE_END  0x02   /* Last record of the cycle */
+
+#define HISTORY_MAX_NAMES_SIZE (16 * 1024 * 1024)
+
+static gint historyEnabled = 1;
+static gint historyRecords = HISTORY_RECORDS_DEFAULT;
+static gint historyFd = -1;
+static guint64 historyErrors;
+static HistoryHeader historyHeader;
+static GArray *historyPending;
+static GHashTable *historyIds;     /* Name to index + 1 */
+static guint32 historyNames;       /* Names in the file and in historyNewNames */
+static GString *historyNewNames;   /* Names not written yet */
+
+/*
+ * Optional chart of resolve latency and mismatches under the panels.
+ */
+static gint showChart;
+static GkrellmChart *chart;
+static GkrellmChartconfig *chartConfig;
+static GkrellmChartdata *latencyCd;
+static GkrellmChartdata *mismatchCd;
+static GtkWidget *chartVbox;
+
+/*
+ * Unix domain control socket, see control_command() for the protocol.
+ */
+#define CONTROL_MAX_LINE 4096
+
+typedef struct
+{
+  gint       fd;
+  GIOChannel *channel;
+  guint      watch;
+  GString    *in;
+  GString    *out;
+  gchar      *check_glob;  /* Waiting for the check run to finish */
+} ControlClient;
+
+static gint controlEnabled;
+static gint controlFd = -1;
+static guint controlWatch;
+static gchar *controlPath;
+static GList *controlClients;
+
+/* 
+ * Create Config tab widgets.
+ */ 
+static GtkWidget *domainEntry;
+static GtkWidget *toggleButton;
+static GtkWidget *historyButton;
+static GtkWidget *historyRecordsSpin;
+static GtkWidget *chartButton;
+static GtkWidget *lookupTimeoutSpin;
+static GtkWidget *cycleDeadlineSpin;
+static GtkWidget *upstreamInFlightSpin;
+static GtkWidget *upstreamRateSpin;
+static GtkWidget *upstreamBurstSpin;
+static GtkWidget *tcpConnectionsSpin;
+static GtkWidget *controlButton;
+static GtkWidget *gatewayButton;
+static GtkWidget *gatewayAnnounceButton;
+static GtkWidget *gatewayEntry;
+static GtkWidget *metricsEntry;
+static GtkWidget *domainFileEntry;
+static GtkWidget *domainVbox;
+static GtkWidget *fileVbox;
+/*
+ * Listbox widget for the config tab.
+ */
+static GtkWidget *domainCList;
+
+/*
+ * Keep track of selected item in the Config listbox.
+ */
+static gint selectedRow;
+
+
+static off_t history_names_offset ()
+{
+    return sizeof (HistoryHeader)
+           + (off_t) historyHeader.capacity * sizeof (HistoryRecord);
+}
+
+/*
+ * Read the names after the ring into historyIds.
+ */
+static gboolean history_load_names ()
+{
+    gchar *names;
+    gchar *name;
+    gchar *end;
+
+    historyIds = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    historyNames = 0;
+    if (historyHeader.names_size == 0)
+        return TRUE;
+    names = g_malloc (historyHeader.names_size);
+    if (pread (historyFd, names, historyHeader.names_size,
+               history_names_offset ()) != (ssize_t) historyHeader.names_size
+        || names[historyHeader.names_size - 1] != '\0')
+    {
+        g_free (names);
+        return FALSE;
+    }
+    end = names + historyHeader.names_size;
+    for (name = names; name < end; name += strlen (name) + 1) {
+        historyNames += 1;
+        g_hash_table_insert (historyIds, g_strdup (name),
+                             GUINT_TO_POINTER (historyNames));
+    }
+    g_free (names);
+    return TRUE;
+}
+
+/*
+ * Open the history file, or start a new one if the existing file was
+ * written with another record layout or ring size.
+ */
+static gboolean history_open ()
+{
+    gchar *path;
+    ssize_t n;
+
+    if (historyFd >= 0)
+        return TRUE;
+
+    path = gkrellm_make_data_file_name (DATA_DIR, HISTORY_FILE);
+    historyFd = open (path, O_RDWR | O_CREAT, 0644);
+    if (historyFd < 0) {
+        debug("Failed to open history file %s\n", path);
+        g_free (path);
+        return FALSE;
+    }
+    debug("History file %s\n", path);
+    g_free (path);
+
+    n = pread (historyFd, &historyHeader, sizeof (historyHeader), 0);
+    if (n != sizeof (historyHeader)
+        || historyHeader.magic != HISTORY_MAGIC
+        || historyHeader.record_size != sizeof (HistoryRecord)
+        || historyHeader.capacity != (guint32) historyRecords
+        || historyHeader.next >= historyHeader.capacity
+        || historyHeader.names_size > HISTORY_MAX_NAMES_SIZE
+        || !history_load_names ())
+    {
+        debug("Starting new history with %d records\n", historyRecords);
+        if (historyIds)
+            g_hash_table_destroy (historyIds);
+        historyIds = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+        historyNames = 0;
+        historyHeader.magic = HISTORY_MAGIC;
+        historyHeader.record_size = sizeof (HistoryRecord);
+        historyHeader.capacity = historyRecords;
+        historyHeader.next = 0;
+        historyHeader.names_size = 0;
+        if (ftruncate (historyFd, 0) != 0
+            || pwrite (historyFd, &historyHeader, sizeof (historyHeader), 0)
+               != sizeof (historyHeader))
+        {
+            close (historyFd);
+            historyFd = -1;
+            g_hash_table_destroy (historyIds);
+            historyIds = NULL;
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void history_close ()
+{
+    if (historyFd >= 0) {
+        close (historyFd);
+        historyFd = -1;
+    }
+    if (historyIds) {
+        g_hash_table_destroy (historyIds);
+        historyIds = NULL;
+    }
+    if (historyNewNames)
+        g_string_truncate (historyNewNames, 0);
+}
+
+/*
+ * Index of the domain's name, added to the names when it is new.  A new
+ * name is dropped again if history_flush() fails to write it.
+ */
+static guint32 history_domain_id (GDomain *domain)
+{
+    guint32 id;
+
+    id = GPOINTER_TO_UINT (g_hash_table_lookup (historyIds, domain->domain));
+    if (id)
+        return id - 1;
+    if (!historyNewNames)
+        historyNewNames = g_string_new (NULL);
+    g_string_append_len (historyNewNames, domain->domain,
+                         strlen (domain->domain) + 1);
+    historyNames += 1;
+    g_hash_table_insert (historyIds, g_strdup (domain->domain),
+                         GUINT_TO_POINTER (historyNames));
+    return historyNames - 1;
+}
+
+static void history_append (GDomain *domain, guint32 domain_ip,
+                            guint32 external_ip)
+{
+    HistoryRecord record;
+
+    if (!historyEnabled)
+        return;
+    if (!history_open ()) {
+        historyErrors += 1;
+        return;
+    }
+    if (!historyPending)
+        historyPending = g_array_new (FALSE, FALSE, sizeof (HistoryRecord));
+
+    record.time = time (NULL);
+    record.domain_id = history_domain_id (domain);
+    record.domain_ip = domain_ip;
+    record.external_ip = external_ip;
+    record.latency_ms = MIN (domain->latency_ms, G_MAXUINT16);
+    record.outcome = domain->status;
+    record.flags = 0;
+    g_array_append_val (historyPending, record);
+}
+
+/*
+ * The names added since the last flush could not be written.  They are
+ * forgotten, and so are the pending records that refer to them, so that
+ * no record in the file points past its names.
+ */
+static void history_drop_new_names ()
+{
+    HistoryRecord *records;
+    gchar *name;
+    gchar *end;
+    guint32 n;
+    guint32 kept = 0;
+
+    end = historyNewNames->str + historyNewNames->len;
+    for (name = historyNewNames->str; name < end; name += strlen (name) + 1) {
+        g_hash_table_remove (historyIds, name);
+        historyNames -= 1;
+    }
+    records = (HistoryRecord *) historyPending->data;
+    for (n = 0; n < historyPending->len; n += 1)
+        if (records[n].domain_id < historyNames)
+            records[kept++] = records[n];
+    g_array_set_size (historyPending, kept);
+}
+
+/*
+ * Write the buffered records into the ring, and the names they added
+ * after it.  This is done once per check run with at most three writes
+ * for the names and records and one for the header, and the records of
+ * a check cycle are flagged so the chart can be drawn from them again.
+ * The file is not synced, losing the last cycle on a crash is acceptable.
+ */
+static void history_flush (gboolean cycle)
+{
+    HistoryRecord *records;
+    guint32 count;
+    guint32 n;
+    off_t offset;
+
+    if (!historyPending || historyPending->len == 0)
+        return;
+    if (!history_open ()) {
+        historyErrors += 1;
+        g_array_set_size (historyPending, 0);
+        return;
+    }
+
+    if (historyNewNames && historyNewNames->len > 0) {
+        offset = history_names_offset () + historyHeader.names_size;
+        if (historyHeader.names_size + historyNewNames->len
+            > HISTORY_MAX_NAMES_SIZE
+            || pwrite (historyFd, historyNewNames->str, historyNewNames->len,
+                       offset) != (ssize_t) historyNewNames->len)
+        {
+            debug("Failed to write history names\n");
+            historyErrors += 1;
+            history_drop_new_names ();
+        } else {
+            historyHeader.names_size += historyNewNames->len;
+        }
+        g_string_truncate (historyNewNames, 0);
+        if (historyPending->len == 0)
+            return;
+    }
+
+    records = (HistoryRecord *) historyPending->data;
+    count = historyPending->len;
+    if (cycle) {
+        for (n = 0; n < count; n += 1)
+            records[n].flags |= HISTORY_CYCLE;
+        records[count - 1].flags |= HISTORY_CYCLE_END;
+    }
+    if (count > historyHeader.capacity) {
+        records += count - historyHeader.capacity;
+        count = historyHeader.capacity;
+    }
+
+    while (count > 0) {
+        n = MIN (count, historyHeader.capacity - historyHeader.next);
+        offset = sizeof (HistoryHeader)
+                 + (off_t) historyHeader.next * sizeof (HistoryRecord);
+        if (pwrite (historyFd, records, n * sizeof (HistoryRecord), offset)
+            != (ssize_t) (n * sizeof (HistoryRecord)))
+        {
+            debug("Failed to write history\n");
+            historyErrors += 1;
+            break;
+        }
+        historyHeader.next = (historyHeader.next + n) % historyHeader.capacity;
+        records += n;
+        count -= n;
+    }
+    if (pwrite (historyFd, &historyHeader, sizeof (historyHeader), 0)
+        != sizeof (historyHeader))
+    {
+        debug("Failed to write history header\n");
+        historyErrors += 1;
+    }
+    g_array_set_size (historyPending, 0);
+}
+
+/*
+ * Fill the chart with the last check cycles in the ring, the way
+ * chart_store_cycle() stored them.  The ring is read backwards from the
+ * newest record a chunk at a time, and only until there are as many
+ * cycles as the chart is wide.  A cycle partly overwritten is skipped.
+ */
+#define HISTORY_SEED_CHUNK 4096
+
+static void history_seed_chart ()
+{
+    HistoryRecord *chunk;
+    HistoryRecord *record;
+    gulong  *points;
+    guint32 pos;
+    guint32 left;
+    guint32 n;
+    gint    wanted;
+    gint    count = 0;
+    gint    i;
+    gulong  latency = 0;
+    gulong  mismatches = 0;
+    gint    resolved = 0;
+    gboolean in_cycle = FALSE;
+    gboolean whole = FALSE;
+
+    if (!chart || !historyEnabled || !history_open ())
+        return;
+    wanted = chart->w > 0 ? chart->w : gkrellm_chart_width ();
+    if (wanted <= 0)
+        return;
+    points = g_new (gulong, 2 * wanted);
+    chunk = g_new (HistoryRecord, HISTORY_SEED_CHUNK);
+
+    pos = historyHeader.next;
+    left = historyHeader.capacity;
+    while (left > 0 && count < wanted)
+    {
+        if (pos == 0)
+            pos = historyHeader.capacity;
+        n = MIN (MIN (left, pos), HISTORY_SEED_CHUNK);
+        pos -= n;
+        left -= n;
+        if (pread (historyFd, chunk, n * sizeof (HistoryRecord),
+                   sizeof (HistoryHeader) + (off_t) pos * sizeof (HistoryRecord))
+            != (ssize_t) (n * sizeof (HistoryRecord)))
+            break;
+
+        for (i = n - 1; i >= 0 && count < wanted; i -= 1)
+        {
+            record = &chunk[i];
+
+            /*
+             * Never written, the ring has not wrapped and the cycle
+             * being read is whole.
+             */
+            if (record->time == 0) {
+                whole = TRUE;
+                left = 0;
+                break;
+            }
+            if (in_cycle && (!(record->flags & HISTORY_CYCLE)
+                             || (record->flags & HISTORY_CYCLE_END)))
+            {
+                points[2 * count] = resolved ? latency / resolved : 0;
+                points[2 * count + 1] = mismatches;
+                count += 1;
+                in_cycle = FALSE;
+            }
+            if (record->flags & HISTORY_CYCLE_END) {
+                in_cycle = TRUE;
+                latency = mismatches = 0;
+                resolved = 0;
+            }
+            if (!in_cycle || count >= wanted)
+                continue;
+            if (record->outcome == CHECK_VALID
+                || record->outcome == CHECK_MISMATCH)
+            {
+                latency += record->latency_ms;
+                resolved += 1;
+            }
+            if (record->outcome == CHECK_MISMATCH)
+                mismatches += 1;
+        }
+    }
+    if (in_cycle && whole && count < wanted) {
+        points[2 * count] = resolved ? latency / resolved : 0;
+        points[2 * count + 1] = mismatches;
+        count += 1;
+    }
+
+    while (count > 0) {
+        count -= 1;
+        gkrellm_store_chartdata (chart, 0, points[2 * count],
+                                 points[2 * count + 1]);
+    }
+    g_free (chunk);
+    g_free (points);
+}
+
+/*
+ * Add one point per check cycle to the chart: the average resolve latency
+ * of the domains and the number of domains not matching the external ip.
+ */
+static void chart_store_cycle ()
+{
+    GDomain *domain;
+    GList   *list;
+    gulong  latency = 0;
+    gulong  mismatches = 0;
+    gint    resolved = 0;
+
+    if (!chart)
+        return;
+    for (list = domainList; list; list = list->next)
+    {
+        domain = (GDomain *) list->data;
+        if (domain->from_server != serverMode)
+            continue;
+        if (domain->status == CHECK_VALID || domain->status == CHECK_MISMATCH) {
+            latency += domain->latency_ms;
+            resolved += 1;
+        }
+        if (domain->status == CHECK_MISMATCH)
+            mismatches += 1;
+    }
+    if (resolved)
+        latency /= resolved;
+    gkrellm_store_chartdata (chart, 0, latency, mismatches);
+    gkrellm_draw_chartdata (chart);
+    gkrellm_draw_chart_to_screen (chart);
+}
+
+static void histogram_observe (LatencyHistogram *hist, gint ms)
+{
+    gint i;
+
+    for (i = 0; i < N_LATENCY_BUCKETS; i += 1)
+        if (ms <= latencyBuckets[i])
+            break;
+    hist->bucket[i] += 1;
+    hist->sum_ms += ms;
+    hist->count += 1;
+}
+
+static const gchar *status_name (gint status)
+{
+  switch (status)
+  {
+    case CHECK_VALID:           return "valid";
+    case CHECK_MISMATCH:        return "mismatch";
+    case CHECK_RESOLVE_FAILED:  return "resolve_failed";
+    case CHECK_EXTERNAL_FAILED: return "external_failed";
+    case CHECK_TIMEOUT:         return "timed_out";
+    default:                    return "unchecked";
+  }
+}
+
+/*
+ * The domains shown, the local ones or the ones gkrellmd serves, with a
+ * name listed more than once only the first time, so that no series or
+ * status line comes out twice.  The list is the caller's to free.
+ */
+static GList *shown_domains ()
+{
+  GHashTable *seen;
+  GDomain    *domain;
+  GList      *list;
+  GList      *shown = NULL;
+
+  seen = g_hash_table_new (g_str_hash, g_str_equal);
+  for (list = domainList; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    if (domain->from_server != serverMode
+        || g_hash_table_lookup (seen, domain->domain))
+      continue;
+    g_hash_table_insert (seen, domain->domain, domain);
+    shown = g_list_prepend (shown, domain);
+  }
+  g_hash_table_destroy (seen);
+  return g_list_reverse (shown);
+}
+
+/*
+ * Prometheus metrics, written in the node_exporter textfile format.
+ * Everything exported is a counter or gauge kept up to date by the checks,
+ * so writing the file is only a serialization of the current state.
+ */
+static void metrics_label (GString *out, const gchar *value)
+{
+  for (; *value; value += 1)
+  {
+    if (*value == '\\' || *value == '"')
+      g_string_append_c (out, '\\');
+    if (*value == '\n')
+      g_string_append (out, "\\n");
+    else
+      g_string_append_c (out, *value);
+  }
+}
+
+static void metrics_histogram (GString *out, const gchar *name,
+                               const gchar *domain, LatencyHistogram *hist)
+{
+  GString *labels;
+  guint64 cumulative = 0;
+  gint    i;
+
+  labels = g_string_new (NULL);
+  if (domain)
+  {
+    g_string_append (labels, "domain=\"");
+    metrics_label (labels, domain);
+    g_string_append (labels, "\"");
+  }
+
+  for (i = 0; i < N_LATENCY_BUCKETS; i += 1)
+  {
+    cumulative += hist->bucket[i];
+    g_string_append_printf (out, "%s_bucket{%s%sle=\"%g\"} %" G_GUINT64_FORMAT "\n",
+                            name, labels->str, domain ? "," : "",
+                            latencyBuckets[i] / 1000.0, cumulative);
+  }
+  g_string_append_printf (out, "%s_bucket{%s%sle=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+                          name, labels->str, domain ? "," : "", hist->count);
+  if (domain)
+  {
+    g_string_append_printf (out, "%s_sum{%s} %g\n", name, labels->str,
+                            hist->sum_ms / 1000.0);
+    g_string_append_printf (out, "%s_count{%s} %" G_GUINT64_FORMAT "\n",
+                            name, labels->str, hist->count);
+  }
+  else
+  {
+    g_string_append_printf (out, "%s_sum %g\n", name, hist->sum_ms / 1000.0);
+    g_string_append_printf (out, "%s_count %" G_GUINT64_FORMAT "\n",
+                            name, hist->count);
+  }
+  g_string_free (labels, TRUE);
+}
+
+static void metrics_write ()
+{
+  GDomain       *domain;
+  GList         *domains;
+  GList         *list;
+  GString       *out;
+  GError        *error = NULL;
+  ResolverStats stats[STATS_MAX_UPSTREAMS];
+  ResolverCacheStats cache;
+  gint          i;
+  gint          n;
+
+  if (!metricsFile || !*metricsFile)
+    return;
+
+  out = g_string_sized_new (4096);
+  domains = shown_domains ();
+
+  g_string_append (out, "# HELP domain_check_status Result of the last check, 1 for the current status.\n"
+                        "# TYPE domain_check_status gauge\n");
+  for (list = domains; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    for (i = 0; i < N_CHECK_OUTCOMES; i += 1)
+    {
+      g_string_append (out, "domain_check_status{domain=\"");
+      metrics_label (out, domain->domain);
+      g_string_append_printf (out, "\",status=\"%s\"} %d\n",
+                              status_name (i), domain->status == i);
+    }
+  }
+
+  g_string_append (out, "# HELP domain_check_enabled Whether the domain panel is enabled.\n"
+                        "# TYPE domain_check_enabled gauge\n");
+  for (list = domains; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    g_string_append (out, "domain_check_enabled{domain=\"");
+    metrics_label (out, domain->domain);
+    g_string_append_printf (out, "\"} %d\n", domain->enabled ? 1 : 0);
+  }
+
+  g_string_append (out, "# HELP domain_check_last_check_timestamp_seconds Time of the last check.\n"
+                        "# TYPE domain_check_last_check_timestamp_seconds gauge\n");
+  for (list = domains; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    g_string_append (out, "domain_check_last_check_timestamp_seconds{domain=\"");
+    metrics_label (out, domain->domain);
+    g_string_append_printf (out, "\"} %ld\n", (long) domain->last_check);
+  }
+
+  g_string_append (out, "# HELP domain_check_checks_total Checks by outcome.\n"
+                        "# TYPE domain_check_checks_total counter\n");
+  for (list = domains; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    for (i = CHECK_VALID; i < N_CHECK_OUTCOMES; i += 1)
+    {
+      g_string_append (out, "domain_check_checks_total{domain=\"");
+      metrics_label (out, domain->domain);
+      g_string_append_printf (out, "\",outcome=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                              status_name (i), domain->checks[i]);
+    }
+  }
+
+  g_string_append (out, "# HELP domain_check_resolve_latency_seconds Time to resolve the domain.\n"
+                        "# TYPE domain_check_resolve_latency_seconds histogram\n");
+  for (list = domains; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    metrics_histogram (out, "domain_check_resolve_latency_seconds",
+                       domain->domain, &domain->latency);
+  }
+
+  g_string_append (out, "# HELP domain_check_external_ip_latency_seconds Time to fetch the external ip address.\n"
+                        "# TYPE domain_check_external_ip_latency_seconds histogram\n");
+  metrics_histogram (out, "domain_check_external_ip_latency_seconds",
+                     NULL, &externalStats.latency);
+
+  g_string_append_printf (out,
+      "# HELP domain_check_external_ip_cache_hits_total External ip address lookups served from the cache.\n"
+      "# TYPE domain_check_external_ip_cache_hits_total counter\n"
+      "domain_check_external_ip_cache_hits_total %" G_GUINT64_FORMAT "\n"
+      "# HELP domain_check_external_ip_cache_misses_total External ip address lookups that ran the fetch.\n"
+      "# TYPE domain_check_external_ip_cache_misses_total counter\n"
+      "domain_check_external_ip_cache_misses_total %" G_GUINT64_FORMAT "\n"
+      "# HELP domain_check_errors_total Errors by source.\n"
+      "# TYPE domain_check_errors_total counter\n"
+      "domain_check_errors_total{source=\"external_ip\"} %" G_GUINT64_FORMAT "\n"
+      "domain_check_errors_total{source=\"history\"} %" G_GUINT64_FORMAT "\n"
+      "# HELP domain_check_external_ip_fetches_total External ip address fetches by where the answer came from.\n"
+      "# TYPE domain_check_external_ip_fetches_total counter\n"
+      "domain_check_external_ip_fetches_total{source=\"gateway\"} %" G_GUINT64_FORMAT "\n"
+      "domain_check_external_ip_fetches_total{source=\"dns\"} %" G_GUINT64_FORMAT "\n"
+      "# HELP domain_check_gateway_announcements_total External ip address changes announced by the gateway.\n"
+      "# TYPE domain_check_gateway_announcements_total counter\n"
+      "domain_check_gateway_announcements_total %" G_GUINT64_FORMAT "\n",
+      externalStats.cache_hits, externalStats.cache_misses,
+      externalStats.errors, historyErrors,
+      externalStats.from_gateway, externalStats.from_dns,
+      externalStats.announcements);
+
+  n = resolver_get_stats (stats, STATS_MAX_UPSTREAMS);
+  n = MIN (n, STATS_MAX_UPSTREAMS);
+  g_string_append (out, "# HELP domain_check_resolver_in_flight Lookups waiting for an answer from the nameserver.\n"
+                        "# TYPE domain_check_resolver_in_flight gauge\n");
+  for (i = 0; i < n; i += 1)
+    g_string_append_printf (out, "domain_check_resolver_in_flight{server=\"%s\"} %d\n",
+                            inet_ntoa (stats[i].server), stats[i].in_flight);
+  g_string_append (out, "# HELP domain_check_resolver_queued Lookups queued by the nameserver limits.\n"
+                        "# TYPE domain_check_resolver_queued gauge\n");
+  for (i = 0; i < n; i += 1)
+    g_string_append_printf (out, "domain_check_resolver_queued{server=\"%s\"} %d\n",
+                            inet_ntoa (stats[i].server), stats[i].queued);
+  g_string_append (out, "# HELP domain_check_resolver_max_queued Deepest the queue has been.\n"
+                        "# TYPE domain_check_resolver_max_queued gauge\n");
+  for (i = 0; i < n; i += 1)
+    g_string_append_printf (out, "domain_check_resolver_max_queued{server=\"%s\"} %d\n",
+                            inet_ntoa (stats[i].server), stats[i].max_queued);
+  g_string_append (out, "# HELP domain_check_resolver_queries_total Queries sent to the nameserver, resends included.\n"
+                        "# TYPE domain_check_resolver_queries_total counter\n");
+  for (i = 0; i < n; i += 1)
+    g_string_append_printf (out, "domain_check_resolver_queries_total{server=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                            inet_ntoa (stats[i].server), stats[i].sent);
+  g_string_append (out, "# HELP domain_check_resolver_throttled_total Lookups that had to wait in the queue.\n"
+                        "# TYPE domain_check_resolver_throttled_total counter\n");
+  for (i = 0; i < n; i += 1)
+    g_string_append_printf (out, "domain_check_resolver_throttled_total{server=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                            inet_ntoa (stats[i].server), stats[i].throttled);
+
+  g_string_append (out, "# HELP domain_check_resolver_tcp_connections Open TCP connections to the nameserver.\n"
+                        "# TYPE domain_check_resolver_tcp_connections gauge\n");
+  for (i = 0; i < n; i += 1)
+    g_string_append_printf (out, "domain_check_resolver_tcp_connections{server=\"%s\"} %d\n",
+                            inet_ntoa (stats[i].server), stats[i].connections);
+
+  g_string_append (out, "# HELP domain_check_resolver_srtt_seconds Smoothed round trip time of the nameserver.\n"
+                        "# TYPE domain_check_resolver_srtt_seconds gauge\n");
+  for (i = 0; i < n; i += 1)
+    g_string_append_printf (out, "domain_check_resolver_srtt_seconds{server=\"%s\"} %g\n",
+                            inet_ntoa (stats[i].server), stats[i].srtt_ms / 1000.0);
+  g_string_append (out, "# HELP domain_check_resolver_timeouts_total Queries the nameserver left unanswered.\n"
+                        "# TYPE domain_check_resolver_timeouts_total counter\n");
+  for (i = 0; i < n; i += 1)
+    g_string_append_printf (out, "domain_check_resolver_timeouts_total{server=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                            inet_ntoa (stats[i].server), stats[i].timeouts);
+  g_string_append (out, "# HELP domain_check_resolver_demoted Whether the nameserver is left alone after repeated timeouts.\n"
+                        "# TYPE domain_check_resolver_demoted gauge\n");
+  for (i = 0; i < n; i += 1)
+    g_string_append_printf (out, "domain_check_resolver_demoted{server=\"%s\"} %d\n",
+                            inet_ntoa (stats[i].server), stats[i].demoted ? 1 : 0);
+
+  resolver_get_cache_stats (&cache);
+  g_string_append_printf (out,
+      "# HELP domain_check_resolver_cache_entries Names in the lookup cache.\n"
+      "# TYPE domain_check_resolver_cache_entries gauge\n"
+      "domain_check_resolver_cache_entries %d\n"
+      "# HELP domain_check_resolver_cache_hits_total Lookups answered from the cache alone.\n"
+      "# TYPE domain_check_resolver_cache_hits_total counter\n"
+      "domain_check_resolver_cache_hits_total %" G_GUINT64_FORMAT "\n"
+      "# HELP domain_check_resolver_cache_misses_total Names that had to be asked.\n"
+      "# TYPE domain_check_resolver_cache_misses_total counter\n"
+      "domain_check_resolver_cache_misses_total %" G_GUINT64_FORMAT "\n"
+      "# HELP domain_check_resolver_coalesced_total Lookups that joined a request already on the wire.\n"
+      "# TYPE domain_check_resolver_coalesced_total counter\n"
+      "domain_check_resolver_coalesced_total %" G_GUINT64_FORMAT "\n",
+      cache.entries, cache.hits, cache.misses, cache.coalesced);
+
+  g_string_append_printf (out,
+      "# HELP domain_check_resolver_limit Configured limits per nameserver.\n"
+      "# TYPE domain_check_resolver_limit gauge\n"
+      "domain_check_resolver_limit{limit=\"in_flight\"} %d\n"
+      "domain_check_resolver_limit{limit=\"rate\"} %d\n"
+      "domain_check_resolver_limit{limit=\"burst\"} %d\n",
+      upstreamInFlight, upstreamRate, upstreamBurst);
+
+  /*
+   * g_file_set_contents() writes a temporary file and renames it over
+   * the old one, so the collector never sees a partial file.
+   */
+  if (!g_file_set_contents (metricsFile, out->str, out->len, &error))
+  {
+    debug("Failed to write metrics: %s\n", error->message);
+    g_error_free (error);
+  }
+  g_list_free (domains);
+  g_string_free (out, TRUE);
+}
+
+/*
+ * Called after a batch of checks: write the history and the metrics,
+ * and for a full check cycle add a point to the chart.
+ */
+static void checks_done (gboolean cycle)
+{
+  history_flush (cycle);
+  metrics_write ();
+  if (cycle)
+    chart_store_cycle ();
+}
+
+static void control_checks_done ();
+
+/*
+ * Set the LED of a domain from the result of its last check.
+ */
+static void show_status (GDomain *domain)
+{
+  gchar *tip;
+
+  gkrellm_set_decal_button_index (domain->button, 
+      domain->status == CHECK_VALID ? D_MISC_LED1 : D_MISC_LED0);
+  gkrellm_draw_panel_layers (domain->panel);
+
+  /*
+   * The tooltip shows what the domain resolved through.
+   */
+  tip = g_strdup_printf ("%s\n%s", domain->chain ? domain->chain : domain->domain,
+                         status_name (domain->status));
+  gtk_widget_set_tooltip_text (domain->panel->drawing_area, tip);
+  g_free (tip);
+}
+
+/*
+ * Checks run asynchronously from the main loop.  A check run looks up
+ * the external ip address and the domains, and a domain is compared
+ * with the external ip address once both are known.  The run ends when
+ * every lookup has completed, or when the cycle deadline passes and the
+ * lookups still pending are cancelled and marked as timed out.
+ */
+static void check_record (GDomain *domain, gint status)
+{
+    guint32 external_addr;
+
+    /*
+     * A served result is compared with the address gkrellmd served last.
+     */
+    if (domain->from_server)
+        external_addr = externalAddr.s_addr;
+    else
+        external_addr = externalState == EXTERNAL_OK ? externalAddr.s_addr : 0;
+    domain->status = status;
+    domain->last_check = time (NULL);
+    domain->checks[status] += 1;
+    domain->awaiting_external = FALSE;
+    history_append (domain, domain->addr, external_addr);
+    if (domain->panel)
+        show_status (domain);
+}
+
+/*
+ * Compare a resolved domain with the external ip address.
+ */
+static void check_evaluate (GDomain *domain)
+{
+    if (externalState != EXTERNAL_OK) {
+        debug("Failed to get external ip address\n");
+        check_record (domain, CHECK_EXTERNAL_FAILED);
+    } else if (domain->addr == externalAddr.s_addr) {
+        debug ("Valid!\n");
+        check_record (domain, CHECK_VALID);
+    } else {
+        debug ("FAILED, set icon blue\n");
+        check_record (domain, CHECK_MISMATCH);
+    }
+}
+
+static void run_finish ()
+{
+    debug("Check run done in %ld ms\n", 
+          (long) (g_get_monotonic_time () - runStarted) / 1000);
+    runActive = FALSE;
+    if (runDeadline) {
+        g_source_remove (runDeadline);
+        runDeadline = 0;
+    }
+    externalState = EXTERNAL_UNKNOWN;
+    checks_done (runCycle);
+    runCycle = FALSE;
+    control_checks_done ();
+}
+
+static void run_maybe_finish ()
+{
+    if (runActive && runPending == 0 && externalState != EXTERNAL_PENDING)
+        run_finish ();
+}
+
+/*
+ * The external ip address fetch is done, compare the domains that
+ * were waiting for it.
+ */
+static void external_done ()
+{
+    GDomain *domain;
+    GList   *list;
+
+    if (externalState == EXTERNAL_OK)
+        debug("External ip : %s\n", inet_ntoa (externalAddr));
+    for (list = domainList; list; list = list->next)
+    {
+        domain = (GDomain *) list->data;
+        if (domain->awaiting_external)
+            check_evaluate (domain);
+    }
+    run_maybe_finish ();
+}
+
+static void external_lookup_done (ResolverQuery *query, gpointer data)
+{
+    externalQuery = NULL;
+    histogram_observe (&externalStats.latency, query->latency_ms);
+    if (query->status == RESOLVE_OK) {
+        externalAddr.s_addr = query->addrs[0];
+        externalFetched = time (NULL);
+        externalState = EXTERNAL_OK;
+        externalStats.from_dns += 1;
+    } else {
+        externalStats.errors += 1;
+        externalState = EXTERNAL_FAILED;
+    }
+    external_done ();
+}
+
+static void external_lookup_start ()
+{
+    externalQuery = resolver_lookup (EXTERNAL_IP_NAME, EXTERNAL_IP_SERVERS,
+                                     external_lookup_done, NULL);
+}
+
+static void external_gateway_done (GatewayQuery *query, gpointer data)
+{
+    externalGatewayQuery = NULL;
+    if (query->status != GATEWAY_OK) {
+        /*
+         * No NAT-PMP at the gateway, ask OpenDNS instead.
+         */
+        debug("No external ip from gateway %s, status %d\n",
+              inet_ntoa (query->gateway), query->status);
+        external_lookup_start ();
+        return;
+    }
+    histogram_observe (&externalStats.latency, query->latency_ms);
+    externalAddr = query->addr;
+    externalFetched = time (NULL);
+    externalState = EXTERNAL_OK;
+    externalStats.from_gateway += 1;
+    external_done ();
+}
+
+/*
+ * The gateway announced a new external ip address.  It is taken as
+ * fetched, and if it changed all domains are checked again from
+ * update_plugin().
+ */
+static void external_announced (struct in_addr addr, gpointer data)
+{
+    externalStats.announcements += 1;
+    if (addr.s_addr != externalAddr.s_addr || !externalFetched)
+        force_update = TRUE;
+    externalAddr = addr;
+    externalFetched = time (NULL);
+}
+
+static void gateway_configure ()
+{
+    struct in_addr addr;
+
+    if (gatewayAddress && inet_aton (gatewayAddress, &addr))
+        gateway_set_address (&addr);
+    else
+        gateway_set_address (NULL);
+    if (gatewayAnnounce)
+        gateway_listen (external_announced, NULL);
+    else
+        gateway_unlisten ();
+}
+
+static void domain_lookup_done (ResolverQuery *query, gpointer data)
+{
+    GDomain *domain = data;
+    GString *chain;
+    gint    i;
+
+    domain->query = NULL;
+    domain->latency_ms = query->latency_ms;
+    g_free (domain->chain);
+    domain->chain = NULL;
+    if (query->chain_len > 0) {
+        chain = g_string_new (query->name);
+        for (i = 0; i < query->chain_len; i += 1)
+            g_string_append_printf (chain, " -> %s", query->chain[i]);
+        domain->chain = g_string_free (chain, FALSE);
+    }
+    histogram_observe (&domain->latency, domain->latency_ms);
+    runPending -= 1;
+
+    if (query->status == RESOLVE_OK) {
+        domain->addr = query->addrs[0];
+        debug("Name: %s, %s\n", domain->domain, 
+              inet_ntoa (*(struct in_addr *) &query->addrs[0]));
+        if (externalState == EXTERNAL_PENDING)
+            domain->awaiting_external = TRUE;
+        else
+            check_evaluate (domain);
+    } else {
+        domain->addr = 0;
+        if (query->status == RESOLVE_TIMEOUT) {
+            debug("Timed out resolving : %s\n", domain->domain);
+            check_record (domain, CHECK_TIMEOUT);
+        } else {
+            debug("Failed to get ip address for : %s\n", domain->domain);
+            check_record (domain, CHECK_RESOLVE_FAILED);
+        }
+    }
+    run_maybe_finish ();
+}
+
+/*
+ * Cancel what is still pending when the cycle deadline passes.
+ */
+static gboolean run_deadline (gpointer data)
+{
+    GDomain *domain;
+    GList   *list;
+
+    debug("Check run deadline passed, %d lookups pending\n", runPending);
+    runDeadline = 0;
+    if (externalGatewayQuery) {
+        gateway_cancel (externalGatewayQuery);
+        externalGatewayQuery = NULL;
+        externalStats.errors += 1;
+        externalState = EXTERNAL_FAILED;
+    }
+    if (externalQuery) {
+        resolver_cancel (externalQuery);
+        externalQuery = NULL;
+        externalStats.errors += 1;
+        externalState = EXTERNAL_FAILED;
+    }
+    for (list = domainList; list; list = list->next)
+    {
+        domain = (GDomain *) list->data;
+        if (domain->query) {
+            resolver_cancel (domain->query);
+            domain->query = NULL;
+            domain->addr = 0;
+            runPending -= 1;
+            check_record (domain, CHECK_TIMEOUT);
+        } else if (domain->awaiting_external) {
+            check_record (domain, CHECK_TIMEOUT);
+        }
+    }
+    run_finish ();
+    return FALSE;
+}
+
+static void run_start ()
+{
+    runActive = TRUE;
+    runStarted = g_get_monotonic_time ();
+    runDeadline = g_timeout_add_seconds (cycleDeadline, run_deadline, NULL);
+    resolver_reload ();
+
+    /*
+     * The external ip address is reused for EXTERNAL_IP_TTL seconds,
+     * it rarely changes between runs started by hand.
+     */
+    if (externalFetched && time (NULL) - externalFetched < EXTERNAL_IP_TTL) {
+        externalStats.cache_hits += 1;
+        externalState = EXTERNAL_OK;
+    } else {
+        externalStats.cache_misses += 1;
+        externalState = EXTERNAL_PENDING;
+        if (gatewayEnabled)
+            externalGatewayQuery = gateway_lookup (external_gateway_done, NULL);
+        else
+            external_lookup_start ();
+    }
+}
+
+/*
+ * Start checking a domain, in the current run if there is one.
+ */
+static void check_domain (GDomain *domain)
+{
+    gchar *line;
+
+    if (domain->from_server) {
+        line = g_strdup_printf ("check %s\n", domain->domain);
+        gkrellm_client_send_to_server (PLUGIN_CONFIG_KEYWORD, line);
+        g_free (line);
+        if (serverVersion >= 2)
+            serverChecks = TRUE;
+        return;
+    }
+    if (domain->query || serverMode)
+        return;
+    if (!runActive)
+        run_start ();
+    domain->awaiting_external = FALSE;
+    domain->query = resolver_lookup (domain->domain, NULL,
+                                     domain_lookup_done, domain);
+    runPending += 1;
+}
+
+static gboolean run_finish_idle (gpointer data)
+{
+    run_maybe_finish ();
+    return FALSE;
+}
+
+/*
+ * Drop the pending check of a domain that is about to be freed.  The
+ * caller may be walking domainList, so a run left with nothing pending
+ * is finished from an idle callback.
+ */
+static void check_cancel_domain (GDomain *domain)
+{
+    domain->awaiting_external = FALSE;
+    if (domain->query) {
+        resolver_cancel (domain->query);
+        domain->query = NULL;
+        runPending -= 1;
+        if (runPending == 0)
+            g_idle_add (run_finish_idle, NULL);
+    }
+}
+
+/*
+ * Cancel everything, the plugin is going away.
+ */
+static void check_cancel_all ()
+{
+    GList *list;
+
+    for (list = domainList; list; list = list->next)
+        check_cancel_domain ((GDomain *) list->data);
+    if (externalGatewayQuery) {
+        gateway_cancel (externalGatewayQuery);
+        externalGatewayQuery = NULL;
+    }
+    if (externalQuery) {
+        resolver_cancel (externalQuery);
+        externalQuery = NULL;
+    }
+    if (runDeadline) {
+        g_source_remove (runDeadline);
+        runDeadline = 0;
+    }
+    runActive = FALSE;
+    runPending = 0;
+    externalState = EXTERNAL_UNKNOWN;
+}
+
+/* 
+ * Handle decal button presses
+ */ 
+static void buttonPress (GkrellmDecalbutton *button, GDomain *domain)
+{
+    debug("Button pressed\n");
+    check_domain (domain);
+}
+
+static gint panel_expose_event (GtkWidget *widget, GdkEventExpose *ev)
+{
+  GDomain *domain;
+  GList     *list;
+  
+  /*
+   * O.K. This isn't particularly efficient, but in the interests of 
+   * maintainability, I'm going to keep this in.
+   */ 
+  for (list = domainList; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    if (widget == domain->panel->drawing_area)
+    {
+      gdk_draw_pixmap (widget->window,
+                       widget->style->fg_gc[GTK_WIDGET_STATE (widget)],
+                       domain->panel->pixmap, ev->area.x, ev->area.y, 
+                      ev->area.x, ev->area.y, ev->area.width, ev->area.height);
+    }
+  }  
+
+  if (chart && widget == chart->drawing_area)
+  {
+    gdk_draw_pixmap (widget->window,
+                     widget->style->fg_gc[GTK_WIDGET_STATE (widget)],
+                     chart->pixmap, ev->area.x, ev->area.y,
+                     ev->area.x, ev->area.y, ev->area.width, ev->area.height);
+  }
+
+  return FALSE;
+}
+
+/*
+ * Func called by create_plugin() & apply_config() to show/hide panels 
+ * at startup according to related config item.
+ */ 
+static void setVisibility ()
+{
+  GDomain *domain;
+  GList     *list;
+
+  for (list = domainList ; list ; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    if (domain->enabled == 0 || serverMode != domain->from_server)
+    {
+      gkrellm_panel_hide (domain->panel);
+    }
+    else
+    {
+      gkrellm_panel_show (domain->panel);
+    }  
+  }  
+
+  if (chart)
+  {
+    if (showChart)
+      gkrellm_chart_show (chart, FALSE);
+    else
+      gkrellm_chart_hide (chart, FALSE);
+  }
+}
+  
+static void update_plugin ()
+{
+    GDomain *domain;
+    GList     *list;
+
+    if (serverMode)
+        return;
+    if (GK.hour_tick || force_update) {   
+        debug("Update_plugin function\n");
+        force_update = FALSE;
+        for (list = domainList; list; list = list->next)
+        {
+            domain = (GDomain *) list->data;
+            check_domain (domain);
+        } 
+
+        /*
+         * Lookups always finish from the main loop, so a run going now
+         * holds the checks of the cycle.  With nothing to check no run
+         * starts and the next one, maybe a CHECK, is not a cycle.
+         */
+        if (runActive)
+            runCycle = TRUE;
+    } else if (checkNew) {
+        /*
+         * Domains added from the domain list file are checked straight
+         * away, the others keep their last result.
+         */
+        for (list = domainList; list; list = list->next)
+        {
+            domain = (GDomain *) list->data;
+            if (domain->last_check == 0)
+                check_domain (domain);
+        }
+        checkNew = FALSE;
+    }
+}
+
+/*
+ * Create the panel, LED button and text decal of one domain.
+ * Used by create_plugin(), apply_plugin_config() and the control socket.
+ * With first_create FALSE only the decals of an existing panel are rebuilt,
+ * as needed when GKrellM recreates the monitors after a theme change.
+ */
+static void create_domain_panel (GDomain *domain, gint first_create)
+{
+  GkrellmStyle     *style;
+  GkrellmTextstyle *ts_alt;
+  GkrellmMargin    *m;
+
+  style = gkrellm_meter_style (style_id);
+  ts_alt = gkrellm_meter_alt_textstyle (style_id);
+  m = gkrellm_get_style_margins(style);
+
+  if (first_create)
+  {
+    domain->panel = gkrellm_panel_new0();
+  }
+
+  domain->led_decal = gkrellm_create_decal_pixmap(domain->panel,
+      gkrellm_decal_misc_pixmap(), gkrellm_decal_misc_mask(),
+      N_MISC_DECALS, style, -1, -1);
+  domain->led_decal->x =
+      gkrellm_chart_width() - domain->led_decal->w - m->right;
+
+  domain->decal = gkrellm_create_decal_text (domain->panel,
+                          domain->domain, ts_alt, style, -1, -1, 
+                          gkrellm_chart_width() - domain->led_decal->w - m->right);
+
+  /*
+   * Configure the panel to created decal, and create it.
+   */
+  gkrellm_panel_configure (domain->panel, NULL, style);
+  gkrellm_panel_create (domain->from_file || domain->from_server ? 
+                        fileVbox : domainVbox, 
+                        monitor, domain->panel);
+
+  /* 
+   * After the panel is created, the decal can be converted into a button.
+   * First draw the initial text into the text decal and then
+   * put the LED decal into a meter button.  
+   */
+  gkrellm_draw_decal_text (domain->panel, domain->decal, 
+                            domain->domain, 1);
+  domain->button = gkrellm_make_decal_button(domain->panel, domain->led_decal,
+      buttonPress, domain, 
+      domain->status == CHECK_VALID ? D_MISC_LED1 : D_MISC_LED0, -1);
+
+  if (first_create)
+  {
+    /*
+     * Connect our panel to the expose event to allow it to be drawn in 
+     * update_plugin().
+     */ 
+    gtk_signal_connect (GTK_OBJECT (domain->panel->drawing_area), 
+                "expose_event", (GtkSignalFunc) panel_expose_event, NULL);
+  }
+}
+
+/*
+ * Append to domainList without walking it.  Whatever else changes the
+ * list sets domainListEnd to NULL, and it is looked up again here.
+ */
+static void domain_list_append (GDomain *domain)
+{
+  if (!domainList)
+    domainListEnd = NULL;
+  else if (!domainListEnd)
+    domainListEnd = g_list_last (domainList);
+  domainListEnd = g_list_append (domainListEnd, domain);
+  if (!domainList)
+    domainList = domainListEnd;
+  else
+    domainListEnd = domainListEnd->next;
+}
+
+static void free_domain (GDomain *domain)
+{
+  check_cancel_domain (domain);
+  if (domain->from_server && serverDomains)
+    g_hash_table_remove (serverDomains, domain->domain);
+  if (domain->panel)
+    gkrellm_panel_destroy (domain->panel);
+  g_free (domain->chain);
+  g_free (domain->domain);
+  g_free (domain);
+}
+
+static GDomain *find_domain (const gchar *name)
+{
+  GDomain *domain;
+  GList   *list;
+
+  for (list = domainList; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    if (!strcmp (domain->domain, name))
+      return domain;
+  }
+  return NULL;
+}
+
+/*
+ * Control socket
+ */
+static void control_status_line (GString *out, GDomain *domain)
+{
+  gchar **links;
+  gint  i;
+
+  g_string_append_printf (out, "%s enabled=%d status=%s latency_ms=%d last_check=%ld",
+                          domain->domain, domain->enabled, 
+                          status_name (domain->status), domain->latency_ms,
+                          (long) domain->last_check);
+
+  /*
+   * CNAMEs followed, as chain=first,second,...
+   */
+  if (domain->chain)
+  {
+    links = g_strsplit (domain->chain, " -> ", 0);
+    for (i = 1; links[i]; i += 1)
+      g_string_append_printf (out, "%s%s", i == 1 ? " chain=" : ",", links[i]);
+    g_strfreev (links);
+  }
+  g_string_append_c (out, '\n');
+}
+
+static void control_add (GString *out, const gchar *name)
+{
+  GDomain *domain;
+  gchar   *buffer[2];
+  gint    row;
+
+  if (!*name || strpbrk (name, " \t"))
+  {
+    g_string_append (out, "ERR invalid domain\n");
+    return;
+  }
+  if (find_domain (name))
+  {
+    g_string_append (out, "ERR domain exists\n");
+    return;
+  }
+
+  domain = g_new0 (GDomain, 1);
+  domain->enabled = 1;
+  domain->domain = g_strdup (name);
+  domain_list_append (domain);
+  create_domain_panel (domain, TRUE);
+
+  /*
+   * Local domains stay hidden while gkrellmd serves the domains.
+   */
+  if (serverMode)
+    gkrellm_panel_hide (domain->panel);
+  else
+    gkrellm_panel_show (domain->panel);
+
+  /*
+   * Keep an open config tab in step, or the next apply would drop the domain.
+   */
+  if (domainCList)
+  {
+    buffer[0] = "Yes";
+    buffer[1] = domain->domain;
+    row = gtk_clist_append (GTK_CLIST (domainCList), buffer);
+    gtk_clist_set_row_data (GTK_CLIST (domainCList), row, domain);
+  }
+  g_string_append (out, "OK\n");
+}
+
+static void control_delete (GString *out, const gchar *name)
+{
+  GDomain *domain;
+  gint    row;
+
+  domain = find_domain (name);
+  if (!domain)
+  {
+    g_string_append (out, "ERR no such domain\n");
+    return;
+  }
+  if (domainCList)
+  {
+    row = gtk_clist_find_row_from_data (GTK_CLIST (domainCList), domain);
+    if (row >= 0)
+    {
+      gtk_clist_remove (GTK_CLIST (domainCList), row);
+      selectedRow = -1;
+    }
+  }
+  domainList = g_list_remove (domainList, domain);
+  domainListEnd = NULL;
+  free_domain (domain);
+  g_string_append (out, "OK\n");
+}
+
+static void control_stats (GString *out)
+{
+  GDomain *domain;
+  GList   *list;
+  gint    count[N_CHECK_OUTCOMES] = { 0 };
+  gint    domains = 0;
+  gint    enabled = 0;
+  gint    i;
+  gint    n;
+  ResolverStats stats[STATS_MAX_UPSTREAMS];
+  ResolverCacheStats cache;
+
+  for (list = domainList; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    domains += 1;
+    enabled += domain->enabled ? 1 : 0;
+    count[domain->status] += 1;
+  }
+  g_string_append_printf (out, "domains %d\n", domains);
+  g_string_append_printf (out, "enabled %d\n", enabled);
+  for (i = 0; i < N_CHECK_OUTCOMES; i += 1)
+    g_string_append_printf (out, "%s %d\n", status_name (i), count[i]);
+  g_string_append_printf (out, "history_pending %u\n",
+                          historyPending ? historyPending->len : 0);
+  g_string_append_printf (out, "clients %u\n", g_list_length (controlClients));
+  g_string_append_printf (out, "limit_in_flight %d\n", upstreamInFlight);
+  g_string_append_printf (out, "limit_rate %d\n", upstreamRate);
+  g_string_append_printf (out, "limit_burst %d\n", upstreamBurst);
+  g_string_append_printf (out, "tcp_connections %d\n", tcpConnections);
+  resolver_get_cache_stats (&cache);
+  g_string_append_printf (out, "cache_entries %d\n", cache.entries);
+  g_string_append_printf (out, "cache_hits %" G_GUINT64_FORMAT "\n", cache.hits);
+  g_string_append_printf (out, "cache_misses %" G_GUINT64_FORMAT "\n", cache.misses);
+  g_string_append_printf (out, "cache_coalesced %" G_GUINT64_FORMAT "\n", 
+                          cache.coalesced);
+
+  /*
+   * One line per nameserver:
+   * resolver <addr> <in flight> <queued> <max queued> <tokens> <sent>
+   *          <throttled> <tcp connections> <srtt ms> <timeouts>
+   *          <demoted>
+   */
+  n = MIN (resolver_get_stats (stats, STATS_MAX_UPSTREAMS), STATS_MAX_UPSTREAMS);
+  for (i = 0; i < n; i += 1)
+    g_string_append_printf (out, "resolver %s %d %d %d %.1f %" G_GUINT64_FORMAT
+                            " %" G_GUINT64_FORMAT " %d %.1f %" G_GUINT64_FORMAT
+                            " %d\n",
+                            inet_ntoa (stats[i].server), stats[i].in_flight,
+                            stats[i].queued, stats[i].max_queued,
+                            stats[i].tokens, stats[i].sent, stats[i].throttled,
+                            stats[i].connections, stats[i].srtt_ms,
+                            stats[i].timeouts, stats[i].demoted ? 1 : 0);
+  g_string_append (out, "OK\n");
+}
+
+/*
+ * Answer a CHECK once the check run is done.
+ */
+static void control_check_reply (ControlClient *client)
+{
+  GDomain *domain;
+  GList   *domains;
+  GList   *list;
+  gint    checked = 0;
+
+  domains = shown_domains ();
+  for (list = domains; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    if (!g_pattern_match_simple (client->check_glob, domain->domain))
+      continue;
+    control_status_line (client->out, domain);
+    checked += 1;
+  }
+  g_list_free (domains);
+  g_string_append_printf (client->out, "OK %d\n", checked);
+  g_free (client->check_glob);
+  client->check_glob = NULL;
+}
+
+/*
+ * Handle one command line from a control client, appending the
+ * response to out.  Every response ends with an "OK" or "ERR" line.
+ */
+static void control_command (ControlClient *client, gchar *line)
+{
+  GDomain *domain;
+  GList   *domains;
+  GList   *list;
+  GString *out = client->out;
+  gchar   *arg;
+
+  g_strstrip (line);
+  arg = strchr (line, ' ');
+  if (arg)
+  {
+    *arg++ = '\0';
+    g_strchug (arg);
+  }
+  else
+  {
+    arg = "";
+  }
+  debug("Control command: %s %s\n", line, arg);
+
+  if (!g_ascii_strcasecmp (line, "STATUS"))
+  {
+    domains = shown_domains ();
+    for (list = domains; list; list = list->next)
+      control_status_line (out, (GDomain *) list->data);
+    g_list_free (domains);
+    g_string_append (out, "OK\n");
+  }
+  else if (!g_ascii_strcasecmp (line, "CHECK"))
+  {
+    client->check_glob = g_strdup (*arg ? arg : "*");
+    for (list = domainList; list; list = list->next)
+    {
+      domain = (GDomain *) list->data;
+      if (g_pattern_match_simple (client->check_glob, domain->domain))
+        check_domain (domain);
+    }
+
+    /*
+     * The reply waits for the run, here or in gkrellmd, unless nothing
+     * was started.
+     */
+    if (!runActive && !serverChecks)
+      control_check_reply (client);
+  }
+  else if (!g_ascii_strcasecmp (line, "ADD"))
+  {
+    control_add (out, arg);
+  }
+  else if (!g_ascii_strcasecmp (line, "DEL"))
+  {
+    control_delete (out, arg);
+  }
+  else if (!g_ascii_strcasecmp (line, "STATS"))
+  {
+    control_stats (out);
+  }
+  else if (*line)
+  {
+    g_string_append (out, "ERR unknown command\n");
+  }
+}
+
+static gboolean control_client_io (GIOChannel *channel, GIOCondition cond,
+                                   gpointer data);
+
+/*
+ * Run the complete command lines received, up to a CHECK that has to
+ * wait for its check run.
+ */
+static void control_client_process (ControlClient *client)
+{
+  gchar *eol;
+
+  while (!client->check_glob
+         && (eol = memchr (client->in->str, '\n', client->in->len)))
+  {
+    *eol = '\0';
+    control_command (client, client->in->str);
+    g_string_erase (client->in, 0, eol - client->in->str + 1);
+  }
+}
+
+static void control_client_close (ControlClient *client)
+{
+  debug("Control client closed\n");
+  controlClients = g_list_remove (controlClients, client);
+  g_source_remove (client->watch);
+  g_io_channel_unref (client->channel);
+  close (client->fd);
+  g_string_free (client->in, TRUE);
+  g_string_free (client->out, TRUE);
+  g_free (client->check_glob);
+  g_free (client);
+}
+
+/*
+ * Write as much of the pending output as the socket takes, and only
+ * watch for G_IO_OUT while something is left.  Input is not read while
+ * a CHECK is waiting, so pipelined commands stay in the socket.
+ */
+static gboolean control_client_flush (ControlClient *client)
+{
+  ssize_t n;
+  GIOCondition cond;
+
+  while (client->out->len > 0)
+  {
+    n = write (client->fd, client->out->str, client->out->len);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        break;
+      return FALSE;
+    }
+    g_string_erase (client->out, 0, n);
+  }
+
+  cond = G_IO_HUP | G_IO_ERR;
+  if (!client->check_glob)
+    cond |= G_IO_IN;
+  if (client->out->len > 0)
+    cond |= G_IO_OUT;
+  g_source_remove (client->watch);
+  client->watch = g_io_add_watch (client->channel, cond,
+                                  control_client_io, client);
+  return TRUE;
+}
+
+static gboolean control_client_io (GIOChannel *channel, GIOCondition cond,
+                                   gpointer data)
+{
+  ControlClient *client = data;
+  gchar   buf[4096];
+  ssize_t n;
+
+  if (cond & G_IO_IN)
+  {
+    n = read (client->fd, buf, sizeof (buf));
+    if (n <= 0 && !(n < 0 && (errno == EINTR || errno == EAGAIN)))
+    {
+      control_client_close (client);
+      return FALSE;
+    }
+    if (n > 0)
+      g_string_append_len (client->in, buf, n);
+
+    control_client_process (client);
+    if (client->in->len > CONTROL_MAX_LINE)
+    {
+      control_client_close (client);
+      return FALSE;
+    }
+  }
+  else if (cond & (G_IO_HUP | G_IO_ERR))
+  {
+    control_client_close (client);
+    return FALSE;
+  }
+
+  if (!control_client_flush (client))
+  {
+    control_client_close (client);
+  }
+  /*
+   * control_client_flush() has replaced this watch.
+   */
+  return FALSE;
+}
+
+static gboolean control_accept (GIOChannel *channel, GIOCondition cond,
+                                gpointer data)
+{
+  ControlClient *client;
+  gint fd;
+
+  fd = accept (controlFd, NULL, NULL);
+  if (fd < 0)
+    return TRUE;
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+  debug("Control client connected\n");
+  client = g_new0 (ControlClient, 1);
+  client->fd = fd;
+  client->channel = g_io_channel_unix_new (fd);
+  client->in = g_string_new (NULL);
+  client->out = g_string_new (NULL);
+  client->watch = g_io_add_watch (client->channel, 
+                                  G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                  control_client_io, client);
+  controlClients = g_list_append (controlClients, client);
+  return TRUE;
+}
+
+/*
+ * A check run finished, answer the clients waiting on a CHECK.
+ */
+static void control_checks_done ()
+{
+  ControlClient *client;
+  GList *list;
+  GList *next;
+
+  for (list = controlClients; list; list = next)
+  {
+    next = list->next;
+    client = (ControlClient *) list->data;
+    if (!client->check_glob)
+      continue;
+    control_check_reply (client);
+    control_client_process (client);
+    if (!control_client_flush (client))
+      control_client_close (client);
+  }
+}
+
+static void control_stop ()
+{
+  while (controlClients)
+    control_client_close ((ControlClient *) controlClients->data);
+  if (controlFd < 0)
+    return;
+
+  g_source_remove (controlWatch);
+  close (controlFd);
+  controlFd = -1;
+  unlink (controlPath);
+  g_free (controlPath);
+  controlPath = NULL;
+  debug("Control socket closed\n");
+}
+
+static void control_start ()
+{
+  struct sockaddr_un addr;
+  GIOChannel *channel;
+  mode_t     mask;
+  gboolean   bound;
+
+  if (controlFd >= 0)
+    return;
+
+  controlPath = gkrellm_make_data_file_name (DATA_DIR, CONTROL_FILE);
+  if (strlen (controlPath) >= sizeof (addr.sun_path))
+  {
+    debug("Control socket path too long: %s\n", controlPath);
+    g_free (controlPath);
+    controlPath = NULL;
+    return;
+  }
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, controlPath);
+
+  controlFd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (controlFd < 0)
+    return;
+  fcntl (controlFd, F_SETFL, fcntl (controlFd, F_GETFL) | O_NONBLOCK);
+  fcntl (controlFd, F_SETFD, FD_CLOEXEC);
+
+  /*
+   * A stale socket is left behind if GKrellM was killed.  The socket is
+   * created 0600 by bind() under a umask that leaves out group and others,
+   * so there is no moment another user could connect to it.
+   */
+  unlink (controlPath);
+  mask = umask (0177);
+  bound = bind (controlFd, (struct sockaddr *) &addr, sizeof (addr)) == 0;
+  umask (mask);
+  if (!bound || listen (controlFd, 8) < 0)
+  {
+    debug("Failed to listen on %s\n", controlPath);
+    close (controlFd);
+    controlFd = -1;
+    g_free (controlPath);
+    controlPath = NULL;
+    return;
+  }
+
+  channel = g_io_channel_unix_new (controlFd);
+  controlWatch = g_io_add_watch (channel, G_IO_IN, control_accept, NULL);
+  g_io_channel_unref (channel);
+  debug("Control socket listening on %s\n", controlPath);
+}
+
+/*
+ * Domain list file
+ */
+typedef struct
+{
+  gchar    *name;
+  gint     enabled;
+  gboolean seen;
+} FileEntry;
+
+/*
+ * Read the domain list file and apply the difference to domainList:
+ * panels are only created for added domains and destroyed for removed
+ * ones, unchanged domains keep their panel and last result.  The file
+ * is read a line at a time and looked up in a hash table, so a reload
+ * is linear in the size of the file and of domainList.
+ * If the file can't be read the current domains are kept.
+ */
+static gboolean domain_file_reload ()
+{
+  FILE       *f;
+  gchar      *line = NULL;
+  size_t     size = 0;
+  gchar      *name;
+  gchar      *p;
+  GHashTable *names;
+  GPtrArray  *entries;
+  FileEntry  *entry;
+  GDomain    *domain;
+  GList      *list;
+  GList      *next;
+  GList      *added = NULL;
+  gint       n_added = 0;
+  gint       n_removed = 0;
+  gint       n_changed = 0;
+  guint      i;
+  gint64     start;
+
+  start = g_get_monotonic_time ();
+  entries = g_ptr_array_new ();
+  names = g_hash_table_new (g_str_hash, g_str_equal);
+
+  if (domainFile && *domainFile)
+  {
+    f = fopen (domainFile, "r");
+    if (!f)
+    {
+      debug("Failed to read domain file %s\n", domainFile);
+      g_ptr_array_free (entries, TRUE);
+      g_hash_table_destroy (names);
+      return FALSE;
+    }
+    while (getline (&line, &size, f) >= 0)
+    {
+      name = g_strstrip (line);
+      if (!*name || *name == '#')
+        continue;
+      p = name + strcspn (name, " \t");
+      if (*p)
+        *p++ = '\0';
+      if (g_hash_table_lookup (names, name))
+        continue;
+
+      entry = g_new (FileEntry, 1);
+      entry->name = g_strdup (name);
+      entry->enabled = *p ? (atoi (p) ? 1 : 0) : 1;
+      entry->seen = FALSE;
+      g_ptr_array_add (entries, entry);
+      g_hash_table_insert (names, entry->name, entry);
+    }
+    free (line);
+    fclose (f);
+  }
+
+  for (list = domainList; list; list = next)
+  {
+    next = list->next;
+    domain = (GDomain *) list->data;
+    entry = g_hash_table_lookup (names, domain->domain);
+
+    /*
+     * Names already in the config are not added again from the file.
+     */
+    if (!domain->from_file)
+    {
+      if (entry)
+        entry->seen = TRUE;
+      continue;
+    }
+    if (!entry || entry->seen)
+    {
+      domainList = g_list_delete_link (domainList, list);
+      domainListEnd = NULL;
+      free_domain (domain);
+      n_removed += 1;
+      continue;
+    }
+    entry->seen = TRUE;
+    if (domain->enabled != entry->enabled)
+    {
+      domain->enabled = entry->enabled;
+      if (domain->enabled)
+        gkrellm_panel_show (domain->panel);
+      else
+        gkrellm_panel_hide (domain->panel);
+      n_changed += 1;
+    }
+  }
+
+  for (i = 0; i < entries->len; i += 1)
+  {
+    entry = g_ptr_array_index (entries, i);
+    if (!entry->seen)
+    {
+      domain = g_new0 (GDomain, 1);
+      domain->domain = g_strdup (entry->name);
+      domain->enabled = entry->enabled;
+      domain->from_file = 1;
+      create_domain_panel (domain, TRUE);
+      if (!domain->enabled)
+        gkrellm_panel_hide (domain->panel);
+      added = g_list_prepend (added, domain);
+      n_added += 1;
+    }
+    g_free (entry->name);
+    g_free (entry);
+  }
+  domainList = g_list_concat (domainList, g_list_reverse (added));
+  domainListEnd = NULL;
+  if (n_added)
+    checkNew = TRUE;
+
+  g_ptr_array_free (entries, TRUE);
+  g_hash_table_destroy (names);
+  debug("Domain file reloaded in %ld us: %d added, %d removed, %d changed\n",
+        (long) (g_get_monotonic_time () - start), n_added, n_removed, n_changed);
+  return TRUE;
+}
+
+static gboolean domain_file_reload_timeout (gpointer data)
+{
+  reloadTimeout = 0;
+  domain_file_reload ();
+  return FALSE;
+}
+
+/*
+ * inotify watches the directory, so that a file replaced by a rename
+ * is seen as well as one written in place.  Events are collected for
+ * DOMAIN_FILE_RELOAD_DELAY ms before reloading.
+ */
+static gboolean domain_file_event (GIOChannel *channel, GIOCondition cond,
+                                   gpointer data)
+{
+  union
+  {
+    struct inotify_event event;
+    gchar buf[4096];
+  } events;
+  struct inotify_event *event;
+  gchar    *base;
+  gchar    *p;
+  ssize_t  n;
+  gboolean changed = FALSE;
+
+  n = read (inotifyFd, &events, sizeof (events));
+  if (n <= 0)
+    return TRUE;
+
+  base = g_path_get_basename (domainFile);
+  for (p = events.buf; p < events.buf + n; 
+       p += sizeof (struct inotify_event) + event->len)
+  {
+    event = (struct inotify_event *) p;
+    if (event->len && !strcmp (event->name, base))
+      changed = TRUE;
+  }
+  g_free (base);
+
+  if (changed && !reloadTimeout)
+    reloadTimeout = g_timeout_add (DOMAIN_FILE_RELOAD_DELAY, 
+                                   domain_file_reload_timeout, NULL);
+  return TRUE;
+}
+
+static void domain_file_stop ()
+{
+  if (reloadTimeout)
+  {
+    g_source_remove (reloadTimeout);
+    reloadTimeout = 0;
+  }
+  if (inotifyFd >= 0)
+  {
+    g_source_remove (inotifyWatch);
+    close (inotifyFd);
+    inotifyFd = -1;
+    inotifyWd = -1;
+  }
+}
+
+/*
+ * (Re)start watching domainFile and load it.  With no file set, this
+ * removes the domains read from a previous file.
+ */
+static void domain_file_start ()
+{
+  GIOChannel *channel;
+  gchar      *dir;
+
+  domain_file_stop ();
+  if (domainFile && *domainFile)
+  {
+    inotifyFd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd >= 0)
+    {
+      dir = g_path_get_dirname (domainFile);
+      inotifyWd = inotify_add_watch (inotifyFd, dir, 
+                                     IN_CLOSE_WRITE | IN_MOVED_TO);
+      if (inotifyWd < 0)
+        debug("Failed to watch %s\n", dir);
+      g_free (dir);
+
+      channel = g_io_channel_unix_new (inotifyFd);
+      inotifyWatch = g_io_add_watch (channel, G_IO_IN, 
+                                     domain_file_event, NULL);
+      g_io_channel_unref (channel);
+    }
+  }
+  domain_file_reload ();
+}
+
+/*
+ * gkrellmd sends its version as setup when it runs the server plugin.
+ * The line is passed on after the key it was served under, the key is
+ * skipped in case a gkrellmd leaves it in front.
+ */
+static void server_setup (gchar *line)
+{
+  gint version;
+
+  if (!strncmp (line, PLUGIN_CONFIG_KEYWORD " ",
+                strlen (PLUGIN_CONFIG_KEYWORD " ")))
+    line += strlen (PLUGIN_CONFIG_KEYWORD " ");
+  if (sscanf (line, "version %d", &version) != 1 || version < 1)
+    return;
+  debug("gkrellmd checks the domains, server plugin version %d\n", version);
+  serverMode = TRUE;
+  serverVersion = version;
+  if (domainVbox)
+    setVisibility ();
+}
+
+/*
+ * The served domain called name, created if it is new.
+ */
+static GDomain *server_domain (const gchar *name)
+{
+  GDomain *domain;
+
+  if (!serverDomains)
+    serverDomains = g_hash_table_new (g_str_hash, g_str_equal);
+  domain = g_hash_table_lookup (serverDomains, name);
+  if (domain)
+    return domain;
+
+  domain = g_new0 (GDomain, 1);
+  domain->domain = g_strdup (name);
+  domain->enabled = 1;
+  domain->from_server = 1;
+  domain_list_append (domain);
+  g_hash_table_insert (serverDomains, domain->domain, domain);
+  if (fileVbox)
+    create_domain_panel (domain, TRUE);
+  return domain;
+}
+
+/*
+ * Lines served by gkrellmd, see domain_check.h.  The result of a check
+ * is recorded like one done here, and the end of a run stores the
+ * history, metrics and chart and answers the waiting CHECKs.
+ */
+static void server_data (gchar *line)
+{
+  GDomain        *domain;
+  GList          *list;
+  GList          *next;
+  GString        *chain;
+  gchar          name[256];
+  gchar          address[16];
+  gchar          links[1024];
+  gchar          **link;
+  struct in_addr addr;
+  gboolean       result;
+  gint           status;
+  gint           latency;
+  gint           cycle;
+  gint           i;
+
+  if (sscanf (line, "done %d", &cycle) == 1)
+  {
+    serverChecks = FALSE;
+    checks_done (cycle);
+    control_checks_done ();
+    return;
+  }
+  if (g_str_has_prefix (line, "clear"))
+  {
+    /*
+     * gkrellmd was connected again, the run a CHECK waits for won't be
+     * served.
+     */
+    if (serverChecks)
+    {
+      serverChecks = FALSE;
+      control_checks_done ();
+    }
+    for (list = domainList; list; list = next)
+    {
+      next = list->next;
+      domain = (GDomain *) list->data;
+      if (!domain->from_server)
+        continue;
+      domainList = g_list_delete_link (domainList, list);
+      domainListEnd = NULL;
+      free_domain (domain);
+    }
+    return;
+  }
+  if (sscanf (line, "ip %255s", name) == 1)
+  {
+    if (inet_aton (name, &addr))
+    {
+      externalAddr = addr;
+      externalFetched = time (NULL);
+    }
+    else
+    {
+      externalAddr.s_addr = 0;
+    }
+    return;
+  }
+
+  links[0] = '\0';
+  result = line[0] == 'r';
+  if (result)
+  {
+    if (sscanf (line, "r %d %255s %15s %d %1023s", &status, name, address,
+                &latency, links) < 4)
+      return;
+  }
+  else if (sscanf (line, "s %d %255s %1023s", &status, name, links) < 2)
+  {
+    return;
+  }
+  status = CLAMP (status, CHECK_NONE, CHECK_TIMEOUT);
+  domain = server_domain (name);
+  g_free (domain->chain);
+  domain->chain = NULL;
+  if (links[0])
+  {
+    chain = g_string_new (name);
+    link = g_strsplit (links, ",", 0);
+    for (i = 0; link[i]; i += 1)
+      g_string_append_printf (chain, " -> %s", link[i]);
+    g_strfreev (link);
+    domain->chain = g_string_free (chain, FALSE);
+  }
+
+  if (result)
+  {
+    domain->addr = inet_aton (address, &addr) ? addr.s_addr : 0;
+    domain->latency_ms = MAX (latency, 0);
+    histogram_observe (&domain->latency, domain->latency_ms);
+    check_record (domain, status);
+    return;
+  }
+  domain->status = status;
+  domain->last_check = time (NULL);
+  if (domain->panel)
+    show_status (domain);
+}
 
 /* 
- * Create Config tab widgets.
- */ 
-static GtkWidget *domainEntry;
-static GtkWidget *toggleButton;
-static GtkWidget *domainVbox;
-/*
- * Listbox widget for the config tab.
+ * Configuration
  */
-static GtkWidget *domainCList;
 
 /*
- * Keep track of selected item in the Config listbox.
+ * FNV-1a, enough to tell a torn or stale file.
  */
-static gint selectedRow;
-
+static guint32 config_cache_checksum (const guchar *data, gsize len)
+{
+  guint32 hash = 2166136261u;
+  gsize   i;
 
-static void debug(const char *fmt, ...) {
-    #ifdef DEBUG_FLAG
-    int size = 0;
-    char *p = NULL;
-    va_list ap;
-
-    /* Determine required size */
-
-    va_start(ap, fmt);
-    size = vsnprintf(p, size, fmt, ap);
-    va_end(ap);
-
-    if (size < 0)
-	    return;
-
-    size++;             /* For '\0' */
-    p = malloc(size);
-    if (p == NULL)
-	    return;
-
-    va_start(ap, fmt);
-    size = vsnprintf(p, size, fmt, ap);
-    if (size < 0) {
-	    free(p);
-	    return;
-    }
-    va_end(ap);
-    g_debug("DEBUG: %s", p);
-    free(p);
-    #endif
-}
-
-static int update_status(GDomain *domain)
-{
-    struct hostent *hstnm;
-    struct in_addr **addr_list;
-    FILE *fp;
-    char externalip[256];
-    char *fgets_result;
-    char *domainip;
-    int ok = 1;
-    int result = 0;
-    char command[256];
-
-    hstnm = gethostbyname(domain->domain);
-    if (hstnm) {
-        sprintf(command, "host myip.opendns.com resolver1.opendns.com | grep -i myip | awk '{print $4}' | head -1");
-        fp = popen(command, "r");
-        if (fp == NULL) {
-            debug("Failed to run command : %s\n", command);
-            ok = 0;
-        } else {
-            fgets_result = fgets(externalip, sizeof(externalip), fp);
-            debug("Read : *%s*\n", externalip);
-            if (strlen(externalip)<7) {
-                ok = 0;
-            } else {
-                char *tmp_pt;
-                if ((tmp_pt = strchr(externalip,'\n'))) {
-                    *tmp_pt = '\0';
-                    debug("Newline removed : *%s*\n", externalip);
-                }
-            }
-           
-        }
-        if (ok) {
-            addr_list = (struct in_addr **) hstnm->h_addr_list;
-	        domainip = inet_ntoa(*addr_list[0]);
-	        debug("Name: %s, %s\n", hstnm->h_name, domainip);
-	        if (strcmp(externalip, domainip)==0) {
-	            debug ("Valid!\n");
-	            result = 1;
-	        } else {
-	            debug ("FAILED, set icon blue\n");
-	        }
-        } else {
-            debug("Failed to get external ip address\n");
-        }
-    } else {
-        debug("Failed to get ip address for : %s\n", domain->domain);
-    }
-    return result;
+  for (i = 0; i < len; i += 1)
+  {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+  return hash;
 }
 
-/* 
- * Handle decal button presses
- */ 
-static void buttonPress (GkrellmDecalbutton *button, GDomain *domain)
+/*
+ * Add the domains of the binary copy to domainList, if it is there and
+ * has the checksum the text config was saved with.
+ */
+static gboolean config_cache_load (guint32 checksum)
 {
-	int result = 0;
-	
-    debug("Button pressed\n");
-    result = update_status(domain);
-    if (result == 1) {
-        gkrellm_set_decal_button_index(button, D_MISC_LED1);
-        debug("Make the led green\n");
-    } else {
-        gkrellm_set_decal_button_index(button, D_MISC_LED0);                
-        debug("Make the led blue\n");
-    }    
-    if (result == 2) {
-    	force_update = TRUE; 
-	}
-}
+  ConfigCacheHeader      *header;
+  const ConfigCacheEntry *entries;
+  const gchar            *names;
+  GDomain                *domain;
+  GList                  *newList = NULL;
+  struct stat            st;
+  gchar                  *path;
+  gsize                  size;
+  guint32                i;
+  gint                   fd;
+  gboolean               valid;
+
+  path = gkrellm_make_data_file_name (DATA_DIR, CONFIG_CACHE_FILE);
+  fd = open (path, O_RDONLY);
+  g_free (path);
+  if (fd < 0)
+    return FALSE;
+  if (fstat (fd, &st) != 0 || st.st_size < (off_t) sizeof (ConfigCacheHeader))
+  {
+    close (fd);
+    return FALSE;
+  }
+  size = st.st_size;
+  header = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (header == MAP_FAILED)
+    return FALSE;
+
+  entries = (const ConfigCacheEntry *) (header + 1);
+  names = (const gchar *) (entries + header->count);
+  valid = header->magic == CONFIG_CACHE_MAGIC
+          && header->version == CONFIG_CACHE_VERSION
+          && header->entry_size == sizeof (ConfigCacheEntry)
+          && header->checksum == checksum
+          && header->count <= (size - sizeof (*header)) / sizeof (*entries)
+          && size == sizeof (*header)
+                     + (gsize) header->count * sizeof (*entries)
+                     + header->names_size
+          && config_cache_checksum ((const guchar *) entries,
+                                    size - sizeof (*header)) == checksum;
 
-static gint panel_expose_event (GtkWidget *widget, GdkEventExpose *ev)
-{
-  GDomain *domain;
-  GList     *list;
-  
   /*
-   * O.K. This isn't particularly efficient, but in the interests of 
-   * maintainability, I'm going to keep this in.
-   */ 
-  for (list = domainList; list; list = list->next)
+   * The names are used as they are, only checked to be in bounds.
+   */
+  for (i = 0; valid && i < header->count; i += 1)
+    valid = entries[i].name < header->names_size
+            && entries[i].name_len < header->names_size - entries[i].name
+            && names[entries[i].name + entries[i].name_len] == '\0';
+  if (!valid)
   {
-    domain = (GDomain *) list->data;
-    if (widget == domain->panel->drawing_area)
-    {
-      gdk_draw_pixmap (widget->window,
-                       widget->style->fg_gc[GTK_WIDGET_STATE (widget)],
-                       domain->panel->pixmap, ev->area.x, ev->area.y, 
-                      ev->area.x, ev->area.y, ev->area.width, ev->area.height);
-    }
-  }  
+    debug("Domain cache doesn't match the config, reading the domain lines\n");
+    munmap (header, size);
+    return FALSE;
+  }
 
-  return FALSE;
+  for (i = 0; i < header->count; i += 1)
+  {
+    domain = g_new0 (GDomain, 1);
+    domain->domain = g_strndup (names + entries[i].name, entries[i].name_len);
+    domain->enabled = entries[i].enabled;
+    newList = g_list_prepend (newList, domain);
+  }
+  newList = g_list_reverse (newList);
+  domainList = g_list_concat (domainList, newList);
+  domainListEnd = NULL;
+  configCacheNext = newList;
+  debug("Loaded %u domains from the domain cache\n", header->count);
+  munmap (header, size);
+  return TRUE;
 }
 
 /*
- * Func called by create_plugin() & apply_config() to show/hide panels 
- * at startup according to related config item.
- */ 
-static void setVisibility ()
+ * The domain lines following the domain_cache line ended, or one of them
+ * didn't match the binary copy.  The domains of the copy no line matched
+ * are dropped, and any further domain lines are read as text.
+ */
+static void config_cache_end ()
 {
-  GDomain *domain;
-  GList     *list;
+  GList *next;
 
-  for (list = domainList ; list ; list = list->next)
+  if (configCacheNext)
+    debug("Domain lines differ from the domain cache, using the lines\n");
+  while (configCacheNext)
   {
-    domain = (GDomain *) list->data;
-    if (domain->enabled == 0)
-    {
-      gkrellm_panel_hide (domain->panel);
-    }
-    else
-    {
-      gkrellm_panel_show (domain->panel);
-    }  
-  }  
+    next = configCacheNext->next;
+    free_domain ((GDomain *) configCacheNext->data);
+    domainList = g_list_delete_link (domainList, configCacheNext);
+    domainListEnd = NULL;
+    configCacheNext = next;
+  }
+  configCacheLoaded = FALSE;
 }
-  
-static void update_plugin ()
+
+/*
+ * Write the binary copy of the domains saved in the text config, built
+ * in memory and written in one go.  It replaces the old copy only once
+ * it is whole.
+ */
+static gboolean config_cache_save (guint32 *checksum)
 {
-    GDomain *domain;
-    GList     *list;
-    int result = 0;
+  ConfigCacheHeader *header;
+  ConfigCacheEntry  *entries;
+  gchar             *names;
+  GDomain           *domain;
+  GList             *list;
+  gchar             *path;
+  gchar             *tmp;
+  gsize             count = 0;
+  gsize             names_size = 0;
+  gsize             size;
+  gsize             len;
+  gboolean          ok;
+  gint              fd;
 
-    if (GK.hour_tick || force_update) {   
-        debug("Update_plugin function\n");
-        for (list = domainList; list; list = list->next)
-        {
-            domain = (GDomain *) list->data;
-            result = update_status(domain);
-            if (result == 1) {
-                debug("Make the led green\n");
-                gkrellm_set_decal_button_index(domain->button, D_MISC_LED1);                
-            } else {
-                debug("Make the led blue\n");
-                gkrellm_set_decal_button_index(domain->button, D_MISC_LED0);                
-            }
-            gkrellm_draw_panel_layers (domain->panel);
-        } 
-        if (result == 2) { 
-        	force_update = TRUE; 
-        } else {
-        	force_update = FALSE; 
-    	}
-    } 
+  for (list = domainList; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    if (domain->from_file || domain->from_server)
+      continue;
+    count += 1;
+    names_size += strlen (domain->domain) + 1;
+  }
+  if (names_size > G_MAXUINT32)
+    return FALSE;
+
+  size = sizeof (*header) + count * sizeof (*entries) + names_size;
+  header = g_malloc0 (size);
+  entries = (ConfigCacheEntry *) (header + 1);
+  names = (gchar *) (entries + count);
+  header->magic = CONFIG_CACHE_MAGIC;
+  header->version = CONFIG_CACHE_VERSION;
+  header->entry_size = sizeof (*entries);
+  header->count = count;
+  header->names_size = names_size;
+  names_size = 0;
+  for (list = domainList; list; list = list->next)
+  {
+    domain = (GDomain *) list->data;
+    if (domain->from_file || domain->from_server)
+      continue;
+    len = strlen (domain->domain);
+    entries->name = names_size;
+    entries->name_len = len;
+    entries->enabled = domain->enabled;
+    memcpy (names + names_size, domain->domain, len + 1);
+    names_size += len + 1;
+    entries += 1;
+  }
+  header->checksum = config_cache_checksum ((const guchar *) (header + 1),
+                                            size - sizeof (*header));
+
+  path = gkrellm_make_data_file_name (DATA_DIR, CONFIG_CACHE_FILE);
+  tmp = g_strconcat (path, ".new", NULL);
+  fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ok = fd >= 0 && write (fd, header, size) == (ssize_t) size;
+  if (fd >= 0)
+    ok = close (fd) == 0 && ok;
+  ok = ok && rename (tmp, path) == 0;
+  if (!ok)
+  {
+    debug("Failed to write domain cache %s\n", path);
+    unlink (tmp);
+  }
+  *checksum = header->checksum;
+  g_free (tmp);
+  g_free (path);
+  g_free (header);
+  return ok;
 }
 
-/* 
- * Configuration
- */
 static void save_plugin_config (FILE *f)
 {
   GDomain *domain;
   GList     *list;
-  
+  guint32   checksum;
+
+  /*
+   * Ahead of the domain lines, which are only compared with the binary
+   * copy on load when it matches.
+   */
+  if (config_cache_save (&checksum))
+    fprintf (f, "%s domain_cache=%08x\n", PLUGIN_CONFIG_KEYWORD, checksum);
   for (list = domainList; list; list = list->next)
   { 
     domain = (GDomain *) list->data;
+    if (domain->from_file || domain->from_server)
+      continue;
 
     debug ("%s enabled=%d domain=%s\n", 
              PLUGIN_CONFIG_KEYWORD, domain->enabled, domain->domain);
     fprintf (f, "%s enabled=%d domain=%s\n", 
              PLUGIN_CONFIG_KEYWORD, domain->enabled, domain->domain);
   }
+  fprintf (f, "%s history=%d\n", PLUGIN_CONFIG_KEYWORD, historyEnabled);
+  fprintf (f, "%s history_records=%d\n", PLUGIN_CONFIG_KEYWORD, historyRecords);
+  fprintf (f, "%s chart=%d\n", PLUGIN_CONFIG_KEYWORD, showChart);
+  fprintf (f, "%s lookup_timeout=%d\n", PLUGIN_CONFIG_KEYWORD, lookupTimeout);
+  fprintf (f, "%s cycle_deadline=%d\n", PLUGIN_CONFIG_KEYWORD, cycleDeadline);
+  fprintf (f, "%s upstream_in_flight=%d\n", PLUGIN_CONFIG_KEYWORD, 
+           upstreamInFlight);
+  fprintf (f, "%s upstream_rate=%d\n", PLUGIN_CONFIG_KEYWORD, upstreamRate);
+  fprintf (f, "%s upstream_burst=%d\n", PLUGIN_CONFIG_KEYWORD, upstreamBurst);
+  fprintf (f, "%s tcp_connections=%d\n", PLUGIN_CONFIG_KEYWORD, tcpConnections);
+  fprintf (f, "%s control_socket=%d\n", PLUGIN_CONFIG_KEYWORD, controlEnabled);
+  fprintf (f, "%s gateway_ip=%d\n", PLUGIN_CONFIG_KEYWORD, gatewayEnabled);
+  fprintf (f, "%s gateway_announce=%d\n", PLUGIN_CONFIG_KEYWORD, 
+           gatewayAnnounce);
+  fprintf (f, "%s gateway=%s\n", PLUGIN_CONFIG_KEYWORD, 
+           gatewayAddress ? gatewayAddress : "");
+  fprintf (f, "%s metrics_file=%s\n", PLUGIN_CONFIG_KEYWORD, 
+           metricsFile ? metricsFile : "");
+  fprintf (f, "%s domain_file=%s\n", PLUGIN_CONFIG_KEYWORD, 
+           domainFile ? domainFile : "");
+  gkrellm_save_chartconfig (f, chartConfig, PLUGIN_CONFIG_KEYWORD, NULL);
 }
 
 
 static void apply_plugin_config ()
 {
   gchar     *string;
-  gint      i;
   gint      row;
   GDomain *domain;
   GList     *list;
+  GList     *next;
   GList     *newList;
-  GkrellmStyle     *style;
-  GkrellmTextstyle *ts;
-  GkrellmTextstyle *ts_alt;
-  GkrellmMargin *m;
+  gint      records;
   
 
+  /*
+   * Options are applied straight away, they don't touch the panels.
+   */
+  historyEnabled = gtk_toggle_button_get_active 
+                   (GTK_TOGGLE_BUTTON (historyButton)) == TRUE ? 1 : 0;
+  records = gtk_spin_button_get_value_as_int 
+            (GTK_SPIN_BUTTON (historyRecordsSpin));
+  if (records != historyRecords || !historyEnabled)
+  {
+    history_flush (FALSE);
+    history_close ();
+    historyRecords = records;
+  }
+  showChart = gtk_toggle_button_get_active 
+              (GTK_TOGGLE_BUTTON (chartButton)) == TRUE ? 1 : 0;
+  setVisibility ();
+  lookupTimeout = gtk_spin_button_get_value_as_int 
+                  (GTK_SPIN_BUTTON (lookupTimeoutSpin));
+  resolver_set_timeout (lookupTimeout);
+  gateway_set_timeout (lookupTimeout);
+  cycleDeadline = gtk_spin_button_get_value_as_int 
+                  (GTK_SPIN_BUTTON (cycleDeadlineSpin));
+  upstreamInFlight = gtk_spin_button_get_value_as_int 
+                     (GTK_SPIN_BUTTON (upstreamInFlightSpin));
+  upstreamRate = gtk_spin_button_get_value_as_int 
+                 (GTK_SPIN_BUTTON (upstreamRateSpin));
+  upstreamBurst = gtk_spin_button_get_value_as_int 
+                  (GTK_SPIN_BUTTON (upstreamBurstSpin));
+  resolver_set_limits (upstreamInFlight, upstreamRate, upstreamBurst);
+  tcpConnections = gtk_spin_button_get_value_as_int 
+                   (GTK_SPIN_BUTTON (tcpConnectionsSpin));
+  resolver_set_tcp (tcpConnections);
+  controlEnabled = gtk_toggle_button_get_active 
+                   (GTK_TOGGLE_BUTTON (controlButton)) == TRUE ? 1 : 0;
+  if (controlEnabled)
+    control_start ();
+  else
+    control_stop ();
+  gatewayEnabled = gtk_toggle_button_get_active 
+                   (GTK_TOGGLE_BUTTON (gatewayButton)) == TRUE ? 1 : 0;
+  gatewayAnnounce = gtk_toggle_button_get_active 
+                    (GTK_TOGGLE_BUTTON (gatewayAnnounceButton)) == TRUE ? 1 : 0;
+  gkrellm_dup_string (&gatewayAddress, gkrellm_gtk_entry_get_text (&gatewayEntry));
+  gateway_configure ();
+  gkrellm_dup_string (&metricsFile, gkrellm_gtk_entry_get_text (&metricsEntry));
+  string = gkrellm_gtk_entry_get_text (&domainFileEntry);
+  if (strcmp (string, domainFile ? domainFile : ""))
+  {
+    gkrellm_dup_string (&domainFile, string);
+    domain_file_start ();
+  }
+
   if (listModified)
   {
     /*
@@ -350,12 +2869,12 @@ static void apply_plugin_config ()
 
     /*
      * Read each row of the listbox & create a new domain.
-     * Append each domain to the new list.
+     * Prepend each domain to the new list, then put it in row order.
      */ 
     for (row = 0; row < (GTK_CLIST (domainCList)->rows); row += 1)
     {
       domain = g_new0 (GDomain, 1);
-      newList = g_list_append (newList, domain);
+      newList = g_list_prepend (newList, domain);
 
       gtk_clist_set_row_data (GTK_CLIST (domainCList), row, domain);
 
@@ -372,76 +2891,40 @@ static void apply_plugin_config ()
       gkrellm_dup_string (&domain->domain, string);
       
     }
+    newList = g_list_reverse (newList);
 
     /*
-     * Wipe out the old list.
+     * Wipe out the old list, apart from the domains read from the
+     * domain list file or served by gkrellmd which are not in the listbox.
      */
-    while (domainList)
+    list = domainList;
+    while (list)
     {
-      domain = (GDomain *) domainList->data;
-      gkrellm_panel_destroy (domain->panel);
-      domainList = g_list_remove (domainList, domain);
+      next = list->next;
+      domain = (GDomain *) list->data;
+      if (!domain->from_file && !domain->from_server)
+      {
+        domainList = g_list_delete_link (domainList, list);
+        domainListEnd = NULL;
+        free_domain (domain);
+      }
+      list = next;
     }
 
-    /*
-     * And then update to the new list.
-     */
-    domainList = newList;
-    
     /*
      * Since we've destroyed the old list & the panels/decals with it,
      * we have to recreate those associated panels/decals.
      */ 
+    for (list = newList; list; list = list->next)
+    {
+      create_domain_panel ((GDomain *) list->data, TRUE);
+    }
 
     /*
-     * First make sure we have the styles set up.
+     * And then update to the new list.
      */
-    style = gkrellm_meter_style (style_id);
-    ts = gkrellm_meter_textstyle (style_id);
-    ts_alt = gkrellm_meter_alt_textstyle (style_id);
-    m = gkrellm_get_style_margins(style);
-     
-    for (i = 0, list = domainList; list; i += 1, list = list->next)
-    {
-      domain = (GDomain *) list->data;
-      domain->panel = gkrellm_panel_new0();
-
-                            
-      domain->led_decal = gkrellm_create_decal_pixmap(domain->panel,
-			gkrellm_decal_misc_pixmap(), gkrellm_decal_misc_mask(),
-			N_MISC_DECALS, style, -1, -1);
-	  domain->led_decal->x =
-				gkrellm_chart_width() - domain->led_decal->w - m->right;
-      domain->decal = gkrellm_create_decal_text (domain->panel,
-                domain->domain, ts_alt, style, -1, -1, 
-                gkrellm_chart_width() - domain->led_decal->w - m->right);
-                            
-      /*
-       * Configure the panel to the created decal, and create it.
-       */
-      gkrellm_panel_configure (domain->panel, NULL, style);
-      gkrellm_panel_create (domainVbox, monitor, domain->panel);
-
-      /*
-       * Panel's been created so convert the decal into a button.
-       */
-      gkrellm_draw_decal_text (domain->panel, domain->decal,
-                               domain->domain, 1);
-
-
-	  domain->button = gkrellm_make_decal_button(domain->panel, domain->led_decal,
-			buttonPress, domain, D_MISC_LED0, -1);
-                                 
-   
-      /*
-       * Connect our panel to the expose event to allow it to be drawn in 
-       * update_plugin().
-       */ 
-      gtk_signal_connect (GTK_OBJECT (domain->panel->drawing_area),
-                          "expose_event", (GtkSignalFunc) panel_expose_event,
-                          NULL);
-                          
-    }
+    domainList = g_list_concat (newList, domainList);
+    domainListEnd = NULL;
     setVisibility ();
 
     /*
@@ -454,26 +2937,142 @@ static void apply_plugin_config ()
 
 static void load_plugin_config (gchar *arg)
 {
-    gchar     domain_string[255];
-    gchar     enabled[2];
+    gchar     key[32];
+    gchar     *name;
     gint      n;
+    guint32   checksum;
     GDomain *domain;
-    GList     *list;
-
-    n = sscanf (arg, "enabled=%s domain=%[^\n]", enabled, domain_string);
 
-    if (n == 2)
+    /*
+     * Domain lines come first, they are most of the config.  When the
+     * binary copy was loaded a line only has to be the same as the next
+     * domain of the copy.  The name is taken whole, however long.
+     */
+    if (!strncmp (arg, "enabled=", 8))
     {
+        name = strstr (arg, " domain=");
+        if (!name || !name[8])
+            return;
+        name += 8;
+        if (configCacheLoaded)
+        {
+            domain = configCacheNext ? (GDomain *) configCacheNext->data : NULL;
+            if (domain && domain->enabled == atoi (arg + 8)
+                && !strcmp (domain->domain, name))
+            {
+                configCacheNext = configCacheNext->next;
+                return;
+            }
+            config_cache_end ();
+        }
         domain = g_new0 (GDomain, 1);
-        domain->domain = g_strdup (domain_string);
-        domain->enabled = atoi (enabled);
-        domainList = g_list_append (domainList, domain);
+        domain->domain = g_strchomp (g_strdup (name));
+        domain->enabled = atoi (arg + 8);
+        domain_list_append (domain);
+        return;
     }
-    //Is this just to link up the list?
-    for (list = domainList; list; list = list->next)
+    if (configCacheLoaded)
+        config_cache_end ();
+    if (!strncmp (arg, GKRELLM_CHARTCONFIG_KEYWORD " ",
+                  strlen (GKRELLM_CHARTCONFIG_KEYWORD " ")))
     {
-        domain = (GDomain *) list->data;
-    }  
+        gkrellm_load_chartconfig (&chartConfig,
+                                  arg + strlen (GKRELLM_CHARTCONFIG_KEYWORD " "),
+                                  2);
+        return;
+    }
+    if (!strncmp (arg, "metrics_file=", 13))
+    {
+        g_free (metricsFile);
+        metricsFile = g_strstrip (g_strdup (arg + 13));
+        return;
+    }
+    if (!strncmp (arg, "gateway=", 8))
+    {
+        g_free (gatewayAddress);
+        gatewayAddress = g_strstrip (g_strdup (arg + 8));
+        return;
+    }
+    if (!strncmp (arg, "domain_file=", 12))
+    {
+        g_free (domainFile);
+        domainFile = g_strstrip (g_strdup (arg + 12));
+        return;
+    }
+    if (sscanf (arg, "domain_cache=%x", &checksum) == 1)
+    {
+        configCacheLoaded = config_cache_load (checksum);
+        return;
+    }
+    if (sscanf (arg, "%31[^=]=%d", key, &n) == 2)
+    {
+        if (!strcmp (key, "history"))
+        {
+            historyEnabled = n;
+            return;
+        }
+        if (!strcmp (key, "history_records"))
+        {
+            historyRecords = CLAMP (n, 1024, 16 * 1024 * 1024);
+            return;
+        }
+        if (!strcmp (key, "chart"))
+        {
+            showChart = n;
+            return;
+        }
+        if (!strcmp (key, "lookup_timeout"))
+        {
+            lookupTimeout = CLAMP (n, 100, 60000);
+            resolver_set_timeout (lookupTimeout);
+            gateway_set_timeout (lookupTimeout);
+            return;
+        }
+        if (!strcmp (key, "cycle_deadline"))
+        {
+            cycleDeadline = CLAMP (n, 1, 3000);
+            return;
+        }
+        if (!strcmp (key, "upstream_in_flight"))
+        {
+            upstreamInFlight = CLAMP (n, 1, 1024);
+            resolver_set_limits (upstreamInFlight, upstreamRate, upstreamBurst);
+            return;
+        }
+        if (!strcmp (key, "upstream_rate"))
+        {
+            upstreamRate = CLAMP (n, 1, 10000);
+            resolver_set_limits (upstreamInFlight, upstreamRate, upstreamBurst);
+            return;
+        }
+        if (!strcmp (key, "upstream_burst"))
+        {
+            upstreamBurst = CLAMP (n, 1, 10000);
+            resolver_set_limits (upstreamInFlight, upstreamRate, upstreamBurst);
+            return;
+        }
+        if (!strcmp (key, "tcp_connections"))
+        {
+            tcpConnections = CLAMP (n, 0, TCP_CONNECTIONS_MAX);
+            resolver_set_tcp (tcpConnections);
+            return;
+        }
+        if (!strcmp (key, "control_socket"))
+        {
+            controlEnabled = n;
+            return;
+        }
+        if (!strcmp (key, "gateway_ip"))
+        {
+            gatewayEnabled = n;
+            return;
+        }
+        if (!strcmp (key, "gateway_announce"))
+        {
+            gatewayAnnounce = n;
+            return;
+        }
+    }
 }
 
 static void cbMoveUp (GtkWidget *widget, gpointer drawer)
@@ -786,6 +3385,13 @@ static void create_plugin_tab (GtkWidget *tab_vbox)
   gtk_signal_connect (GTK_OBJECT (domainCList), "unselect_row", 
                       (GtkSignalFunc) cListUnSelected, NULL);
 
+  /*
+   * The control socket edits the CList while the config window is open,
+   * so forget it when the window goes away.
+   */
+  gtk_signal_connect (GTK_OBJECT (domainCList), "destroy", 
+                      (GtkSignalFunc) gtk_widget_destroyed, &domainCList);
+
   /* 
    * Add the CList to the scrolling window
    */ 
@@ -794,16 +3400,102 @@ static void create_plugin_tab (GtkWidget *tab_vbox)
   /*
    * Fill the CList with our commands etc.
    */ 
-  for (i = 0, list = domainList; list; i += 1, list = list->next)
+  for (list = domainList; list; list = list->next)
   {  
     domain = (GDomain *) list->data;
+    if (domain->from_file || domain->from_server)
+      continue;
     sprintf (enabled, "%s", (domain->enabled == 1 ? "Yes" : "No"));        
              buffer[0] = enabled;
     buffer[1] = domain->domain;
-    gtk_clist_append (GTK_CLIST (domainCList), buffer);
+    i = gtk_clist_append (GTK_CLIST (domainCList), buffer);
     gtk_clist_set_row_data (GTK_CLIST (domainCList), i, domain);
   }
 
+  /*
+   * Options tab
+   */
+  vbox = gkrellm_gtk_notebook_page (tabs, "Options");
+
+  historyButton = gtk_check_button_new_with_label ("Log check history");
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (historyButton), 
+                                historyEnabled);
+  gtk_box_pack_start (GTK_BOX (vbox), historyButton, FALSE, TRUE, 0);
+
+  gkrellm_gtk_spin_button (vbox, &historyRecordsSpin, (gfloat) historyRecords,
+                           1024.0, 16.0 * 1024 * 1024, 1024.0, 65536.0, 0, 80,
+                           NULL, NULL, FALSE, "History records");
+
+  chartButton = gtk_check_button_new_with_label ("Show history chart");
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (chartButton), showChart);
+  gtk_box_pack_start (GTK_BOX (vbox), chartButton, FALSE, TRUE, 0);
+
+  gkrellm_gtk_spin_button (vbox, &lookupTimeoutSpin, (gfloat) lookupTimeout,
+                           100.0, 60000.0, 100.0, 1000.0, 0, 80,
+                           NULL, NULL, FALSE, "Lookup timeout (ms)");
+  gkrellm_gtk_spin_button (vbox, &cycleDeadlineSpin, (gfloat) cycleDeadline,
+                           1.0, 3000.0, 1.0, 10.0, 0, 80,
+                           NULL, NULL, FALSE, "Check cycle deadline (s)");
+  gkrellm_gtk_spin_button (vbox, &upstreamInFlightSpin, 
+                           (gfloat) upstreamInFlight,
+                           1.0, 1024.0, 1.0, 16.0, 0, 80,
+                           NULL, NULL, FALSE, "Nameserver in-flight limit");
+  gkrellm_gtk_spin_button (vbox, &upstreamRateSpin, (gfloat) upstreamRate,
+                           1.0, 10000.0, 1.0, 10.0, 0, 80,
+                           NULL, NULL, FALSE, "Nameserver rate (lookups/s)");
+  gkrellm_gtk_spin_button (vbox, &upstreamBurstSpin, (gfloat) upstreamBurst,
+                           1.0, 10000.0, 1.0, 10.0, 0, 80,
+                           NULL, NULL, FALSE, "Nameserver burst");
+  gkrellm_gtk_spin_button (vbox, &tcpConnectionsSpin, (gfloat) tcpConnections,
+                           0.0, (gfloat) TCP_CONNECTIONS_MAX, 1.0, 1.0, 0, 80,
+                           NULL, NULL, FALSE, 
+                           "TCP connections per nameserver (0 for UDP)");
+
+  controlButton = gtk_check_button_new_with_label ("Control socket");
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (controlButton), 
+                                controlEnabled);
+  gtk_box_pack_start (GTK_BOX (vbox), controlButton, FALSE, TRUE, 0);
+
+  gatewayButton = gtk_check_button_new_with_label 
+                  ("Ask the gateway for the external ip (NAT-PMP)");
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (gatewayButton), 
+                                gatewayEnabled);
+  gtk_box_pack_start (GTK_BOX (vbox), gatewayButton, FALSE, TRUE, 0);
+
+  gatewayAnnounceButton = gtk_check_button_new_with_label 
+                          ("Listen for gateway announcements");
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (gatewayAnnounceButton), 
+                                gatewayAnnounce);
+  gtk_box_pack_start (GTK_BOX (vbox), gatewayAnnounceButton, FALSE, TRUE, 0);
+
+  label = gtk_label_new ("Gateway address:");
+  gtk_box_pack_start (GTK_BOX (vbox), label, FALSE, FALSE, 0);
+  gtk_label_set_justify (GTK_LABEL (label), GTK_JUSTIFY_LEFT);
+  gtk_misc_set_alignment (GTK_MISC (label), 0, 0);
+
+  gatewayEntry = gtk_entry_new_with_max_length (63);
+  gtk_entry_set_text (GTK_ENTRY (gatewayEntry), 
+                      gatewayAddress ? gatewayAddress : "");
+  gtk_box_pack_start (GTK_BOX (vbox), gatewayEntry, FALSE, FALSE, 0);
+
+  label = gtk_label_new ("Prometheus metrics file:");
+  gtk_box_pack_start (GTK_BOX (vbox), label, FALSE, FALSE, 0);
+  gtk_label_set_justify (GTK_LABEL (label), GTK_JUSTIFY_LEFT);
+  gtk_misc_set_alignment (GTK_MISC (label), 0, 0);
+
+  metricsEntry = gtk_entry_new_with_max_length (255);
+  gtk_entry_set_text (GTK_ENTRY (metricsEntry), metricsFile ? metricsFile : "");
+  gtk_box_pack_start (GTK_BOX (vbox), metricsEntry, FALSE, FALSE, 0);
+
+  label = gtk_label_new ("Domain list file:");
+  gtk_box_pack_start (GTK_BOX (vbox), label, FALSE, FALSE, 0);
+  gtk_label_set_justify (GTK_LABEL (label), GTK_JUSTIFY_LEFT);
+  gtk_misc_set_alignment (GTK_MISC (label), 0, 0);
+
+  domainFileEntry = gtk_entry_new_with_max_length (255);
+  gtk_entry_set_text (GTK_ENTRY (domainFileEntry), domainFile ? domainFile : "");
+  gtk_box_pack_start (GTK_BOX (vbox), domainFileEntry, FALSE, FALSE, 0);
+
   /* 
    * Info tab
    */
@@ -825,73 +3517,52 @@ static void create_plugin_tab (GtkWidget *tab_vbox)
 
 static void create_plugin (GtkWidget *vbox, gint first_create)
 {
-  gint      i;
-  GDomain *domain;
   GList     *list;
-  GkrellmStyle     *style;
-  GkrellmTextstyle *ts;
-  GkrellmTextstyle *ts_alt;
-  GkrellmMargin     *m;
-
-  domainVbox = vbox;
 
   if (first_create)
   {
-    for (list = domainList; list; list = list->next)
-    {
-      domain = (GDomain *) list->data;
-      domain->panel = gkrellm_panel_new0();
-    }
+    /*
+     * In case the config ended with the domain lines.
+     */
+    if (configCacheLoaded)
+      config_cache_end ();
+
+    /*
+     * Panels of configured domains, panels of domains from the domain
+     * list file and the chart go in boxes of their own, so that panels
+     * recreated by apply_plugin_config() or a reload keep their place.
+     */
+    domainVbox = gtk_vbox_new (FALSE, 0);
+    gtk_box_pack_start (GTK_BOX (vbox), domainVbox, FALSE, FALSE, 0);
+    gtk_widget_show (domainVbox);
+    fileVbox = gtk_vbox_new (FALSE, 0);
+    gtk_box_pack_start (GTK_BOX (vbox), fileVbox, FALSE, FALSE, 0);
+    gtk_widget_show (fileVbox);
+    chartVbox = gtk_vbox_new (FALSE, 0);
+    gtk_box_pack_start (GTK_BOX (vbox), chartVbox, FALSE, FALSE, 0);
+    gtk_widget_show (chartVbox);
+
+    chart = gkrellm_chart_new0();
   }  
     
-  style = gkrellm_meter_style (style_id);
-
-  /* 
-   * Each GkrellmStyle has two text styles.  The theme designer has picked the
-   * colors and font sizes, presumably based on knowledge of what you draw
-   * on your panel.  You just do the drawing.  You probably could assume
-   * the ts font is larger than the ts_alt font, but again you can be
-   * overridden by the theme designer.
-   */
-  ts = gkrellm_meter_textstyle (style_id);
-  ts_alt = gkrellm_meter_alt_textstyle (style_id);
-  m = gkrellm_get_style_margins(style);
-
-  /* 
-   * Create a text decal that will be converted to a button.  
-   * Make it the entire width of the panel.
-   */
-  for (i = 0, list = domainList; list; i += 1, list = list->next)
+  for (list = domainList; list; list = list->next)
   {
-    domain = (GDomain *) list->data;
-                            
-    domain->led_decal = gkrellm_create_decal_pixmap(domain->panel,
-        gkrellm_decal_misc_pixmap(), gkrellm_decal_misc_mask(),
-        N_MISC_DECALS, style, -1, -1);
-    domain->led_decal->x =
-        gkrellm_chart_width() - domain->led_decal->w - m->right;
-        
-    domain->decal = gkrellm_create_decal_text (domain->panel,
-                            domain->domain, ts_alt, style, -1, -1, 
-                            gkrellm_chart_width() - domain->led_decal->w - m->right);
-        
+    create_domain_panel ((GDomain *) list->data, first_create);
+  }
+
   /*
-   * Configure the panel to created decal, and create it.
-   */
-    gkrellm_panel_configure (domain->panel, NULL, style);
-    gkrellm_panel_create (vbox, monitor, domain->panel);
-    
-  /* 
-   * After the panel is created, the decal can be converted into a button.
-   * First draw the initial text into the teupdate_pluginxt decal button and then
-   * put the text decal into a meter button.  
+   * History chart: average resolve latency and mismatch count per cycle.
    */
-    gkrellm_draw_decal_text (domain->panel, domain->decal, 
-                              domain->domain,1);
-    domain->button = gkrellm_make_decal_button(domain->panel, domain->led_decal,
-			buttonPress, domain, D_MISC_LED0, -1);                              
-                              
-  }                                            
+  gkrellm_chart_create (chartVbox, monitor, chart, &chartConfig);
+  latencyCd = gkrellm_add_default_chartdata (chart, "Latency ms");
+  gkrellm_monotonic_chartdata (latencyCd, FALSE);
+  gkrellm_set_chartdata_draw_style_default (latencyCd, CHARTDATA_LINE);
+  mismatchCd = gkrellm_add_default_chartdata (chart, "Mismatches");
+  gkrellm_monotonic_chartdata (mismatchCd, FALSE);
+  gkrellm_set_chartdata_draw_style_default (mismatchCd, CHARTDATA_IMPULSE);
+  gkrellm_alloc_chartdata (chart);
+  if (first_create)
+    history_seed_chart ();
 
   /* 
    * Note: all of the above gkrellm_draw_decal_XXX() calls will not
@@ -902,19 +3573,38 @@ static void create_plugin (GtkWidget *vbox, gint first_create)
 
   if (first_create)
   {
-    for (list = domainList; list; list = list->next)
-    {
-      domain = (GDomain *) list->data;
-      gtk_signal_connect (GTK_OBJECT (domain->panel->drawing_area), 
-                  "expose_event", (GtkSignalFunc) panel_expose_event, NULL);
-    }                      
+    gtk_signal_connect (GTK_OBJECT (chart->drawing_area), 
+                "expose_event", (GtkSignalFunc) panel_expose_event, NULL);
     /*
      * Setup the initial enabled status of each panel
      * according to the config item read in.
      */ 
     setVisibility ();
     force_update = TRUE;
+    gateway_configure ();
+    if (controlEnabled)
+      control_start ();
+    if (domainFile && *domainFile)
+      domain_file_start ();
   }
+  else
+  {
+    gkrellm_refresh_chart (chart);
+  }
+}
+
+/*
+ * Called when the plugin is disabled in the plugins config.
+ */
+static void disable_plugin ()
+{
+  domain_file_stop ();
+  control_stop ();
+  gateway_unlisten ();
+  check_cancel_all ();
+  resolver_shutdown ();
+  history_flush (FALSE);
+  history_close ();
 }
 
 
@@ -957,5 +3647,16 @@ GkrellmMonitor* gkrellm_init_plugin ()
   
   style_id = gkrellm_add_meter_style (&plugin_mon, STYLE_NAME);
   monitor = &plugin_mon;
+  gkrellm_disable_plugin_connect (monitor, disable_plugin);
+
+  /*
+   * Take the results from gkrellmd when it runs the server plugin.
+   */
+  if (gkrellm_client_mode ())
+  {
+    gkrellm_client_plugin_get_setup (PLUGIN_CONFIG_KEYWORD, server_setup);
+    gkrellm_client_plugin_serve_data_connect (monitor, PLUGIN_CONFIG_KEYWORD,
+                                              server_data);
+  }
   return &plugin_mon;
 }
@@ -0,0 +1,121 @@
+/*
+ *  Domain_check:
+ *  Declarations shared by the files of the domain check plugin.
+ *
+ *  Copyright (C) 2016 Tommy Skagemo-Andreassen
+ *
+ *  This program is free software which I release under the GNU General Public
+ *  License. You may redistribute and/or modify this program under the terms
+ *  of that license as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef DOMAIN_CHECK_H
+#define DOMAIN_CHECK_H
+
+#include <glib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CONFIG_NAME "DomainCheck"
+
+#define PLUGIN_CONFIG_KEYWORD "domaincheck"
+
+/*
+ * The external ip address is what the gateway answers over NAT-PMP when
+ * that is enabled, otherwise or if it fails what OpenDNS answers for
+ * myip.opendns.com, asked at the fastest of resolver1 to resolver4.
+ */
+#define EXTERNAL_IP_NAME "myip.opendns.com"
+#define EXTERNAL_IP_SERVERS "208.67.222.222 208.67.220.220 208.67.222.220 208.67.220.222"
+#define EXTERNAL_IP_TTL 60
+
+#define LOOKUP_TIMEOUT_DEFAULT 2000
+#define CYCLE_DEADLINE_DEFAULT 30
+#define UPSTREAM_IN_FLIGHT_DEFAULT 64
+#define UPSTREAM_RATE_DEFAULT 100
+#define UPSTREAM_BURST_DEFAULT 20
+#define TCP_CONNECTIONS_MAX 16
+
+/*
+ * Outcome of a check, shown by the LED and stored in the history.
+ */
+enum
+{
+  CHECK_NONE = 0,
+  CHECK_VALID,
+  CHECK_MISMATCH,
+  CHECK_RESOLVE_FAILED,
+  CHECK_EXTERNAL_FAILED,
+  CHECK_TIMEOUT
+};
+
+#define N_CHECK_OUTCOMES (CHECK_TIMEOUT + 1)
+
+/*
+ * When gkrellmd runs the server side plugin, the checks are done there
+ * once for all clients.  The server sends "version <n>" as setup, and
+ * then these lines, served under PLUGIN_CONFIG_KEYWORD:
+ *
+ *   clear                          forget all served domains, sent first
+ *                                  to a newly connected client
+ *   ip <address>                   external ip address, - if unknown
+ *   s <status> <domain> [<chain>]  status of a domain, added if new, with
+ *                                  the CNAMEs followed as a,b,...
+ *   r <status> <domain> <address> <latency ms> [<chain>]
+ *                                  result of a check just done, the
+ *                                  address the domain resolved to or -
+ *   done <cycle>                   a check run finished, cycle is 1 when
+ *                                  it was started by the check interval
+ *
+ * A newly connected client gets clear, ip and an s line per domain, and
+ * after that an r line for every check and done at the end of each run.
+ * A client asks for a check with "check <domain>", and is sent done even
+ * when no run was started for it.
+ */
+#define SERVE_VERSION 2
+
+/*
+ *  Output of debug requires that plugin is called with:
+ *  gkrellm -l <logfilename> -d 0x20000 &
+ *  and that the so is built with "make debug; make install"
+ */
+static inline void debug(const char *fmt, ...) {
+    #ifdef DEBUG_FLAG
+    int size = 0;
+    char *p = NULL;
+    va_list ap;
+
+    /* Determine required size */
+
+    va_start(ap, fmt);
+    size = vsnprintf(p, size, fmt, ap);
+    va_end(ap);
+
+    if (size < 0)
+	    return;
+
+    size++;             /* For '\0' */
+    p = malloc(size);
+    if (p == NULL)
+	    return;
+
+    va_start(ap, fmt);
+    size = vsnprintf(p, size, fmt, ap);
+    if (size < 0) {
+	    free(p);
+	    return;
+    }
+    va_end(ap);
+    g_debug("DEBUG: %s", p);
+    free(p);
+    #endif
+}
+
+#endif
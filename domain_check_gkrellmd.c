@@ -0,0 +1,567 @@
+/*
+ *  Domain_check:
+ *  gkrellmd server plugin.  The domains are checked once in gkrellmd and
+ *  the results served to every connected GKrellM, instead of each client
+ *  looking up the same domains and external ip address.
+ *
+ *  The checks run like in the client plugin: the external ip address is
+ *  fetched from the gateway or from OpenDNS, the domains are looked up by
+ *  resolver.c from the gkrellmd main loop, and a run ends when every
+ *  lookup completed or the cycle deadline passed.  Clients get the status
+ *  of every domain when they connect, and after that the result of every
+ *  check and the end of every run, so that they keep their history,
+ *  metrics and chart like when they check themselves.  See domain_check.h
+ *  for the lines served.
+ *
+ *  Configured with lines in gkrellmd.conf starting with the monitor name,
+ *  followed by the same settings as in the client config:
+ *
+ *    DomainCheck enabled=1 domain=www.example.com
+ *    DomainCheck check_interval=3600
+ *    DomainCheck lookup_timeout=2000
+ *    DomainCheck cycle_deadline=30
+ *    DomainCheck upstream_in_flight=64
+ *    DomainCheck upstream_rate=100
+ *    DomainCheck upstream_burst=20
+ *    DomainCheck tcp_connections=0
+ *    DomainCheck gateway_ip=0
+ *    DomainCheck gateway_announce=0
+ *    DomainCheck gateway=
+ *
+ *  Copyright (C) 2016 Tommy Skagemo-Andreassen
+ *
+ *  This program is free software which I release under the GNU General Public
+ *  License. You may redistribute and/or modify this program under the terms
+ *  of that license as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <gkrellm2/gkrellmd.h>
+#include "domain_check.h"
+#include "resolver.h"
+#include "gateway.h"
+#include <arpa/inet.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Seconds between check runs, an hour like the hour tick of the client.
+ */
+#define CHECK_INTERVAL_DEFAULT 3600
+
+enum
+{
+  EXTERNAL_UNKNOWN = 0,
+  EXTERNAL_PENDING,
+  EXTERNAL_OK,
+  EXTERNAL_FAILED
+};
+
+typedef struct
+{
+  gchar    *domain;
+  gint     enabled;
+  gint     status;
+  gchar    *chain;            /* CNAMEs followed as "a,b", NULL if none */
+  guint32  addr;
+  gint     latency_ms;
+
+  ResolverQuery *query;
+  gboolean      awaiting_external;
+
+  gboolean checked;           /* Result not served yet */
+} ServerDomain;
+
+static GList *domainList;
+static GList *domainListEnd;       /* Last link, appended to in one step */
+static GHashTable *domainNames;    /* Name to ServerDomain */
+
+static gint checkInterval = CHECK_INTERVAL_DEFAULT;
+static gint lookupTimeout = LOOKUP_TIMEOUT_DEFAULT;
+static gint cycleDeadline = CYCLE_DEADLINE_DEFAULT;
+static gint upstreamInFlight = UPSTREAM_IN_FLIGHT_DEFAULT;
+static gint upstreamRate = UPSTREAM_RATE_DEFAULT;
+static gint upstreamBurst = UPSTREAM_BURST_DEFAULT;
+static gint tcpConnections;
+static gint gatewayEnabled;
+static gint gatewayAnnounce;
+static gchar *gatewayAddress;
+
+static gboolean runActive;
+static gboolean runCycle;     /* Started by the check interval */
+static gboolean runDone;      /* End of a run not served yet */
+static gboolean runDoneCycle;
+static gint runPending;
+static guint runDeadline;
+static gint64 runStarted;
+static gboolean forceRun;
+static ResolverQuery *externalQuery;
+static GatewayQuery *externalGatewayQuery;
+static gint externalState;
+static struct in_addr externalAddr;
+static time_t externalFetched;
+static gboolean externalChanged;
+
+static GkrellmdMonitor server_mon;
+
+
+static ServerDomain *find_domain (const gchar *name)
+{
+  if (!domainNames)
+    return NULL;
+  return (ServerDomain *) g_hash_table_lookup (domainNames, name);
+}
+
+/*
+ * Every result is served, the clients record each check.
+ */
+static void check_record (ServerDomain *domain, gint status)
+{
+  domain->awaiting_external = FALSE;
+  domain->status = status;
+  domain->checked = TRUE;
+  gkrellmd_need_serve (&server_mon);
+}
+
+static void check_evaluate (ServerDomain *domain)
+{
+  if (externalState != EXTERNAL_OK)
+    check_record (domain, CHECK_EXTERNAL_FAILED);
+  else if (domain->addr == externalAddr.s_addr)
+    check_record (domain, CHECK_VALID);
+  else
+    check_record (domain, CHECK_MISMATCH);
+}
+
+static void run_finish ()
+{
+  debug("Server check run done in %ld ms\n",
+        (long) (g_get_monotonic_time () - runStarted) / 1000);
+  runActive = FALSE;
+  if (runDeadline)
+  {
+    g_source_remove (runDeadline);
+    runDeadline = 0;
+  }
+  externalState = EXTERNAL_UNKNOWN;
+  runDone = TRUE;
+  runDoneCycle = runCycle;
+  runCycle = FALSE;
+  gkrellmd_need_serve (&server_mon);
+}
+
+static void run_maybe_finish ()
+{
+  if (runActive && runPending == 0 && externalState != EXTERNAL_PENDING)
+    run_finish ();
+}
+
+static void external_set (struct in_addr addr)
+{
+  if (addr.s_addr != externalAddr.s_addr)
+  {
+    externalChanged = TRUE;
+    gkrellmd_need_serve (&server_mon);
+  }
+  externalAddr = addr;
+  externalFetched = time (NULL);
+}
+
+static void external_done ()
+{
+  ServerDomain *domain;
+  GList        *list;
+
+  for (list = domainList; list; list = list->next)
+  {
+    domain = (ServerDomain *) list->data;
+    if (domain->awaiting_external)
+      check_evaluate (domain);
+  }
+  run_maybe_finish ();
+}
+
+static void external_lookup_done (ResolverQuery *query, gpointer data)
+{
+  externalQuery = NULL;
+  if (query->status == RESOLVE_OK)
+  {
+    external_set (*(struct in_addr *) &query->addrs[0]);
+    externalState = EXTERNAL_OK;
+  }
+  else
+  {
+    externalState = EXTERNAL_FAILED;
+  }
+  external_done ();
+}
+
+static void external_lookup_start ()
+{
+  externalQuery = resolver_lookup (EXTERNAL_IP_NAME, EXTERNAL_IP_SERVERS,
+                                   external_lookup_done, NULL);
+}
+
+static void external_gateway_done (GatewayQuery *query, gpointer data)
+{
+  externalGatewayQuery = NULL;
+  if (query->status != GATEWAY_OK)
+  {
+    external_lookup_start ();
+    return;
+  }
+  external_set (query->addr);
+  externalState = EXTERNAL_OK;
+  external_done ();
+}
+
+static void external_announced (struct in_addr addr, gpointer data)
+{
+  if (addr.s_addr != externalAddr.s_addr || !externalFetched)
+    forceRun = TRUE;
+  external_set (addr);
+}
+
+static void domain_lookup_done (ResolverQuery *query, gpointer data)
+{
+  ServerDomain *domain = data;
+  GString      *chain;
+  gint         i;
+
+  domain->query = NULL;
+  domain->latency_ms = query->latency_ms;
+  runPending -= 1;
+
+  chain = g_string_new ("");
+  for (i = 0; i < query->chain_len; i += 1)
+    g_string_append_printf (chain, "%s%s", i ? "," : "", query->chain[i]);
+  g_free (domain->chain);
+  domain->chain = chain->len ? g_strdup (chain->str) : NULL;
+  g_string_free (chain, TRUE);
+
+  if (query->status == RESOLVE_OK)
+  {
+    domain->addr = query->addrs[0];
+    if (externalState == EXTERNAL_PENDING)
+      domain->awaiting_external = TRUE;
+    else
+      check_evaluate (domain);
+  }
+  else
+  {
+    domain->addr = 0;
+    check_record (domain, query->status == RESOLVE_TIMEOUT ?
+                          CHECK_TIMEOUT : CHECK_RESOLVE_FAILED);
+  }
+  run_maybe_finish ();
+}
+
+static gboolean run_deadline (gpointer data)
+{
+  ServerDomain *domain;
+  GList        *list;
+
+  runDeadline = 0;
+  if (externalGatewayQuery)
+  {
+    gateway_cancel (externalGatewayQuery);
+    externalGatewayQuery = NULL;
+    externalState = EXTERNAL_FAILED;
+  }
+  if (externalQuery)
+  {
+    resolver_cancel (externalQuery);
+    externalQuery = NULL;
+    externalState = EXTERNAL_FAILED;
+  }
+  for (list = domainList; list; list = list->next)
+  {
+    domain = (ServerDomain *) list->data;
+    if (domain->query)
+    {
+      resolver_cancel (domain->query);
+      domain->query = NULL;
+      domain->addr = 0;
+      runPending -= 1;
+      check_record (domain, CHECK_TIMEOUT);
+    }
+    else if (domain->awaiting_external)
+    {
+      check_record (domain, CHECK_TIMEOUT);
+    }
+  }
+  run_finish ();
+  return FALSE;
+}
+
+static void run_start ()
+{
+  runActive = TRUE;
+  runStarted = g_get_monotonic_time ();
+  runDeadline = g_timeout_add_seconds (cycleDeadline, run_deadline, NULL);
+  resolver_reload ();
+
+  if (externalFetched && time (NULL) - externalFetched < EXTERNAL_IP_TTL)
+  {
+    externalState = EXTERNAL_OK;
+  }
+  else
+  {
+    externalState = EXTERNAL_PENDING;
+    if (gatewayEnabled)
+      externalGatewayQuery = gateway_lookup (external_gateway_done, NULL);
+    else
+      external_lookup_start ();
+  }
+}
+
+static void check_domain (ServerDomain *domain)
+{
+  if (domain->query || !domain->enabled)
+    return;
+  if (!runActive)
+    run_start ();
+  domain->awaiting_external = FALSE;
+  domain->query = resolver_lookup (domain->domain, NULL,
+                                   domain_lookup_done, domain);
+  runPending += 1;
+}
+
+static void check_all ()
+{
+  GList *list;
+
+  for (list = domainList; list; list = list->next)
+    check_domain ((ServerDomain *) list->data);
+}
+
+static void load_config_line (const gchar *arg)
+{
+  gchar        key[32];
+  gchar        *name;
+  gint         n;
+  ServerDomain *domain;
+
+  if (!strncmp (arg, "gateway=", 8))
+  {
+    g_free (gatewayAddress);
+    gatewayAddress = g_strstrip (g_strdup (arg + 8));
+    return;
+  }
+  /*
+   * The name is taken whole, however long, as the client does.
+   */
+  if (!strncmp (arg, "enabled=", 8))
+  {
+    name = strstr (arg, " domain=");
+    if (!name || !name[8])
+      return;
+    name = g_strchomp (g_strdup (name + 8));
+    if (!*name || find_domain (name))
+    {
+      g_free (name);
+      return;
+    }
+    domain = g_new0 (ServerDomain, 1);
+    domain->domain = name;
+    domain->enabled = atoi (arg + 8);
+    domainListEnd = g_list_append (domainListEnd, domain);
+    if (!domainList)
+      domainList = domainListEnd;
+    else
+      domainListEnd = domainListEnd->next;
+    if (!domainNames)
+      domainNames = g_hash_table_new (g_str_hash, g_str_equal);
+    g_hash_table_insert (domainNames, domain->domain, domain);
+    return;
+  }
+  if (sscanf (arg, "%31[^=]=%d", key, &n) != 2)
+    return;
+
+  if (!strcmp (key, "check_interval"))
+    checkInterval = CLAMP (n, 60, 7 * 24 * 3600);
+  else if (!strcmp (key, "lookup_timeout"))
+    lookupTimeout = CLAMP (n, 100, 60000);
+  else if (!strcmp (key, "cycle_deadline"))
+    cycleDeadline = CLAMP (n, 1, 3000);
+  else if (!strcmp (key, "upstream_in_flight"))
+    upstreamInFlight = CLAMP (n, 1, 1024);
+  else if (!strcmp (key, "upstream_rate"))
+    upstreamRate = CLAMP (n, 1, 10000);
+  else if (!strcmp (key, "upstream_burst"))
+    upstreamBurst = CLAMP (n, 1, 10000);
+  else if (!strcmp (key, "tcp_connections"))
+    tcpConnections = CLAMP (n, 0, TCP_CONNECTIONS_MAX);
+  else if (!strcmp (key, "gateway_ip"))
+    gatewayEnabled = n;
+  else if (!strcmp (key, "gateway_announce"))
+    gatewayAnnounce = n;
+}
+
+static void load_config (GkrellmdMonitor *mon)
+{
+  const gchar    *line;
+  struct in_addr addr;
+
+  while ((line = gkrellmd_config_getline (mon)) != NULL)
+    load_config_line (line);
+
+  resolver_set_timeout (lookupTimeout);
+  resolver_set_limits (upstreamInFlight, upstreamRate, upstreamBurst);
+  resolver_set_tcp (tcpConnections);
+  gateway_set_timeout (lookupTimeout);
+  if (gatewayAddress && inet_aton (gatewayAddress, &addr))
+    gateway_set_address (&addr);
+  if (gatewayAnnounce)
+    gateway_listen (external_announced, NULL);
+  debug("Server config: %d domains, checked every %d s\n",
+        g_list_length (domainList), checkInterval);
+}
+
+static void update_monitor (GkrellmdMonitor *mon, gboolean first_update)
+{
+  if (first_update)
+  {
+    load_config (mon);
+    forceRun = TRUE;
+  }
+  if (runActive)
+    return;
+  if (forceRun || g_get_monotonic_time () - runStarted
+                  >= (gint64) checkInterval * G_USEC_PER_SEC)
+  {
+    forceRun = FALSE;
+    runCycle = TRUE;
+    check_all ();
+  }
+}
+
+/*
+ * The status of a domain, or with result the outcome of the check just
+ * done.
+ */
+static void serve_domain (GkrellmdMonitor *mon, ServerDomain *domain,
+                          gboolean result)
+{
+  struct in_addr addr;
+  gchar          *line;
+
+  addr.s_addr = domain->addr;
+  if (result)
+    line = g_strdup_printf ("r %d %s %s %d%s%s\n", domain->status,
+                            domain->domain,
+                            domain->addr ? inet_ntoa (addr) : "-",
+                            domain->latency_ms,
+                            domain->chain ? " " : "",
+                            domain->chain ? domain->chain : "");
+  else
+    line = g_strdup_printf ("s %d %s%s%s\n", domain->status, domain->domain,
+                            domain->chain ? " " : "",
+                            domain->chain ? domain->chain : "");
+  gkrellmd_serve_data (mon, line);
+  g_free (line);
+}
+
+/*
+ * The status of everything to a client that just connected, otherwise
+ * the checks done and the runs finished since the last serve.  The flags
+ * are cleared by gkrellmd once every client was served.
+ */
+static void serve_data (GkrellmdMonitor *mon, gboolean first_serve)
+{
+  ServerDomain *domain;
+  GList        *list;
+  gchar        *line;
+
+  if (first_serve)
+    gkrellmd_serve_data (mon, "clear\n");
+  if (first_serve || externalChanged)
+  {
+    line = g_strdup_printf ("ip %s\n",
+                            externalFetched ? inet_ntoa (externalAddr) : "-");
+    gkrellmd_serve_data (mon, line);
+    g_free (line);
+    gkrellmd_add_serveflag_done (&externalChanged);
+  }
+  for (list = domainList; list; list = list->next)
+  {
+    domain = (ServerDomain *) list->data;
+    if (!domain->enabled)
+      continue;
+    if (first_serve)
+    {
+      serve_domain (mon, domain, FALSE);
+    }
+    else if (domain->checked)
+    {
+      serve_domain (mon, domain, TRUE);
+      gkrellmd_add_serveflag_done (&domain->checked);
+    }
+  }
+  if (!first_serve && runDone)
+  {
+    line = g_strdup_printf ("done %d\n", runDoneCycle ? 1 : 0);
+    gkrellmd_serve_data (mon, line);
+    g_free (line);
+    gkrellmd_add_serveflag_done (&runDone);
+  }
+}
+
+static void serve_setup (GkrellmdMonitor *mon)
+{
+  gchar *line;
+
+  line = g_strdup_printf ("version %d\n", SERVE_VERSION);
+  gkrellmd_serve_setup (mon, PLUGIN_CONFIG_KEYWORD, line);
+  g_free (line);
+}
+
+/*
+ * "check <domain>" from a client, when its LED button was pressed or on
+ * a CHECK on its control socket.  The result is served to all clients.
+ */
+static void client_input (GkrellmdClient *client, gchar *line)
+{
+  ServerDomain *domain;
+
+  g_strstrip (line);
+  if (strncmp (line, "check ", 6))
+    return;
+  domain = find_domain (line + 6);
+  if (domain)
+    check_domain (domain);
+
+  /*
+   * The client waits for the end of a run, serve one when nothing
+   * was started.
+   */
+  if (!runActive)
+  {
+    runDone = TRUE;
+    gkrellmd_need_serve (&server_mon);
+  }
+}
+
+static GkrellmdMonitor server_mon =
+{
+  CONFIG_NAME,          /* Name, must match the client plugin */
+  update_monitor,       /* The update function                */
+  serve_data,           /* Serve data to clients              */
+  serve_setup           /* Serve setup when a client connects */
+};
+
+/*
+ * gkrellmd looks for gkrellmd_init_plugin() like GKrellM looks for
+ * gkrellm_init_plugin().
+ */
+GkrellmdMonitor *gkrellmd_init_plugin ()
+{
+  gkrellmd_set_serve_name (&server_mon, PLUGIN_CONFIG_KEYWORD);
+  gkrellmd_client_input_connect (&server_mon, client_input);
+  return &server_mon;
+}
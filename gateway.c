@@ -0,0 +1,387 @@
+/*
+ *  Domain_check:
+ *  External ip address from the local gateway over NAT-PMP.
+ *
+ *  The gateway already knows the external ip address, and NAT-PMP
+ *  (RFC 6886) asks it with one UDP packet on the local network instead
+ *  of a lookup leaving the site.  The gateway also multicasts an
+ *  announcement when the address changes, which can be listened for.
+ *
+ *  Gateways speaking PCP (RFC 6887) only answer a NAT-PMP request with
+ *  an unsupported version result, and the caller falls back to another
+ *  way of getting the address.
+ *
+ *  Copyright (C) 2016 Tommy Skagemo-Andreassen
+ *
+ *  This program is free software which I release under the GNU General Public
+ *  License. You may redistribute and/or modify this program under the terms
+ *  of that license as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "domain_check.h"
+#include "gateway.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define PROC_NET_ROUTE "/proc/net/route"
+#define ROUTE_FLAG_GATEWAY 0x2
+
+#define NATPMP_PORT 5351
+#define NATPMP_CLIENT_PORT 5350
+#define NATPMP_ANNOUNCE_GROUP "224.0.0.1"
+#define NATPMP_VERSION 0
+#define NATPMP_OP_EXTERNAL_ADDR 0
+#define NATPMP_OP_RESPONSE 128
+#define NATPMP_RESULT_SUCCESS 0
+#define NATPMP_RESPONSE_SIZE 12
+
+/*
+ * First resend after 250 ms, then doubling, as in RFC 6886.
+ */
+#define NATPMP_INITIAL_INTERVAL 250
+
+static struct in_addr gatewayAddr;
+static gint gatewayTimeout = 2000;
+
+static gint listenFd = -1;
+static guint listenWatch;
+static GatewayAnnounceCallback listenCallback;
+static gpointer listenData;
+
+
+/*
+ * The default gateway of the main routing table.  Addresses in
+ * /proc/net/route are the raw network order words printed in hex.
+ */
+static gboolean default_gateway (struct in_addr *addr)
+{
+  FILE     *f;
+  gchar    line[256];
+  guint    destination;
+  guint    gateway;
+  guint    flags;
+  gboolean found = FALSE;
+
+  if (gatewayAddr.s_addr)
+  {
+    *addr = gatewayAddr;
+    return TRUE;
+  }
+
+  f = fopen (PROC_NET_ROUTE, "r");
+  if (!f)
+    return FALSE;
+  while (!found && fgets (line, sizeof (line), f))
+  {
+    if (sscanf (line, "%*s %x %x %x", &destination, &gateway, &flags) == 3
+        && destination == 0 && (flags & ROUTE_FLAG_GATEWAY))
+    {
+      addr->s_addr = gateway;
+      found = TRUE;
+    }
+  }
+  fclose (f);
+  return found;
+}
+
+/*
+ * Behind a second NAT, or carrier grade NAT, the gateway's external
+ * address is a private, shared (RFC 6598) or link-local one, and not the
+ * address the domains should point to.  Nor is a loopback, "this
+ * network", multicast or reserved address a gateway might report.
+ */
+static gboolean is_public (struct in_addr addr)
+{
+  guint32 a = ntohl (addr.s_addr);
+
+  return (a & 0xff000000) != 0x00000000        /* 0.0.0.0/8 */
+         && (a & 0xff000000) != 0x7f000000     /* 127.0.0.0/8 */
+         && a < 0xe0000000                     /* 224.0.0.0/4 and up */
+         && (a & 0xff000000) != 0x0a000000     /* 10.0.0.0/8 */
+         && (a & 0xfff00000) != 0xac100000     /* 172.16.0.0/12 */
+         && (a & 0xffff0000) != 0xc0a80000     /* 192.168.0.0/16 */
+         && (a & 0xffc00000) != 0x64400000     /* 100.64.0.0/10 */
+         && (a & 0xffff0000) != 0xa9fe0000;    /* 169.254.0.0/16 */
+}
+
+/*
+ * Parse an external address response, or an announcement which has
+ * the same format.  Returns FALSE if it isn't one.  An address that
+ * isn't public is taken as GATEWAY_UNSUPPORTED.
+ */
+static gboolean parse_response (const guchar *buf, gssize len, gint *status,
+                                struct in_addr *addr)
+{
+  gint result;
+
+  if (len < 4 || buf[1] != (NATPMP_OP_RESPONSE | NATPMP_OP_EXTERNAL_ADDR))
+    return FALSE;
+  if (buf[0] != NATPMP_VERSION)
+  {
+    /* A PCP gateway answering with its own version */
+    *status = GATEWAY_UNSUPPORTED;
+    return TRUE;
+  }
+  result = (buf[2] << 8) | buf[3];
+  if (result != NATPMP_RESULT_SUCCESS || len < NATPMP_RESPONSE_SIZE)
+  {
+    *status = GATEWAY_UNSUPPORTED;
+    return TRUE;
+  }
+  memcpy (&addr->s_addr, buf + 8, 4);
+  if (!is_public (*addr))
+  {
+    debug("Gateway external ip %s is not public\n", inet_ntoa (*addr));
+    *status = GATEWAY_UNSUPPORTED;
+    return TRUE;
+  }
+  *status = GATEWAY_OK;
+  return TRUE;
+}
+
+static void complete_query (GatewayQuery *query, gint status)
+{
+  query->status = status;
+  query->latency_ms = (g_get_monotonic_time () - query->started) / 1000;
+  debug("Gateway %s: status %d, %d ms\n", inet_ntoa (query->gateway),
+        query->status, query->latency_ms);
+  query->callback (query, query->data);
+  gateway_cancel (query);
+}
+
+static gboolean send_request (GatewayQuery *query)
+{
+  guchar request[2] = { NATPMP_VERSION, NATPMP_OP_EXTERNAL_ADDR };
+
+  return send (query->fd, request, sizeof (request), 0) == sizeof (request);
+}
+
+static gboolean query_event (GIOChannel *channel, GIOCondition cond,
+                             gpointer data)
+{
+  GatewayQuery   *query = data;
+  guchar         buf[64];
+  struct in_addr addr;
+  gssize         n;
+  gint           status;
+
+  for (;;)
+  {
+    /*
+     * The socket is connected to the gateway, so only its packets and
+     * errors for the requests sent to it arrive here.
+     */
+    n = recv (query->fd, buf, sizeof (buf), 0);
+    if (n < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return TRUE;
+      debug("Gateway request failed: %s\n", strerror (errno));
+      query->watch = 0;
+      complete_query (query, GATEWAY_FAILED);
+      return FALSE;
+    }
+    if (parse_response (buf, n, &status, &addr))
+    {
+      query->addr = addr;
+      query->watch = 0;
+      complete_query (query, status);
+      return FALSE;
+    }
+  }
+}
+
+static gboolean query_resend (gpointer data)
+{
+  GatewayQuery *query = data;
+  gint64       elapsed;
+
+  elapsed = (g_get_monotonic_time () - query->started) / 1000;
+  if (elapsed >= gatewayTimeout)
+  {
+    query->resend = 0;
+    complete_query (query, GATEWAY_TIMEOUT);
+    return FALSE;
+  }
+  send_request (query);
+  query->interval = MIN (query->interval * 2, gatewayTimeout - elapsed);
+  query->resend = g_timeout_add (query->interval, query_resend, query);
+  return FALSE;
+}
+
+/*
+ * Request that could not be sent, completed from the main loop.
+ */
+static gboolean query_failed (gpointer data)
+{
+  GatewayQuery *query = data;
+
+  query->resend = 0;
+  complete_query (query, query->status);
+  return FALSE;
+}
+
+void gateway_set_address (const struct in_addr *addr)
+{
+  gatewayAddr.s_addr = addr ? addr->s_addr : 0;
+}
+
+void gateway_set_timeout (gint timeout_ms)
+{
+  gatewayTimeout = MAX (timeout_ms, NATPMP_INITIAL_INTERVAL);
+}
+
+GatewayQuery *gateway_lookup (GatewayCallback callback, gpointer data)
+{
+  GatewayQuery       *query;
+  GIOChannel         *channel;
+  struct sockaddr_in to;
+
+  query = g_new0 (GatewayQuery, 1);
+  query->callback = callback;
+  query->data = data;
+  query->fd = -1;
+  query->started = g_get_monotonic_time ();
+  query->interval = NATPMP_INITIAL_INTERVAL;
+
+  if (!default_gateway (&query->gateway))
+  {
+    query->status = GATEWAY_NO_GATEWAY;
+    query->resend = g_idle_add (query_failed, query);
+    return query;
+  }
+
+  memset (&to, 0, sizeof (to));
+  to.sin_family = AF_INET;
+  to.sin_port = htons (NATPMP_PORT);
+  to.sin_addr = query->gateway;
+
+  query->fd = socket (AF_INET, SOCK_DGRAM, 0);
+  if (query->fd < 0
+      || connect (query->fd, (struct sockaddr *) &to, sizeof (to)) < 0
+      || !send_request (query))
+  {
+    debug("Failed to send gateway request: %s\n", strerror (errno));
+    query->status = GATEWAY_FAILED;
+    query->resend = g_idle_add (query_failed, query);
+    return query;
+  }
+  fcntl (query->fd, F_SETFL, fcntl (query->fd, F_GETFL) | O_NONBLOCK);
+  fcntl (query->fd, F_SETFD, FD_CLOEXEC);
+
+  channel = g_io_channel_unix_new (query->fd);
+  query->watch = g_io_add_watch (channel, G_IO_IN | G_IO_ERR,
+                                 query_event, query);
+  g_io_channel_unref (channel);
+  query->resend = g_timeout_add (MIN (query->interval, gatewayTimeout),
+                                 query_resend, query);
+  return query;
+}
+
+void gateway_cancel (GatewayQuery *query)
+{
+  if (query->watch)
+    g_source_remove (query->watch);
+  if (query->resend)
+    g_source_remove (query->resend);
+  if (query->fd >= 0)
+    close (query->fd);
+  g_free (query);
+}
+
+static gboolean listen_event (GIOChannel *channel, GIOCondition cond,
+                              gpointer data)
+{
+  guchar             buf[64];
+  struct sockaddr_in from;
+  socklen_t          fromlen;
+  struct in_addr     gateway;
+  struct in_addr     addr;
+  gssize             n;
+  gint               status;
+
+  for (;;)
+  {
+    fromlen = sizeof (from);
+    n = recvfrom (listenFd, buf, sizeof (buf), 0,
+                  (struct sockaddr *) &from, &fromlen);
+    if (n < 0)
+      break;
+
+    /*
+     * Anyone on the link can multicast, only the gateway is believed.
+     */
+    if (!default_gateway (&gateway)
+        || from.sin_addr.s_addr != gateway.s_addr
+        || ntohs (from.sin_port) != NATPMP_PORT)
+      continue;
+    if (parse_response (buf, n, &status, &addr) && status == GATEWAY_OK)
+    {
+      debug("Gateway announced external ip %s\n", inet_ntoa (addr));
+      listenCallback (addr, listenData);
+    }
+  }
+  return TRUE;
+}
+
+gboolean gateway_listen (GatewayAnnounceCallback callback, gpointer data)
+{
+  struct sockaddr_in addr;
+  struct ip_mreq     mreq;
+  GIOChannel         *channel;
+  gint               on = 1;
+
+  listenCallback = callback;
+  listenData = data;
+  if (listenFd >= 0)
+    return TRUE;
+
+  listenFd = socket (AF_INET, SOCK_DGRAM, 0);
+  if (listenFd < 0)
+    return FALSE;
+  setsockopt (listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (NATPMP_CLIENT_PORT);
+  addr.sin_addr.s_addr = htonl (INADDR_ANY);
+  memset (&mreq, 0, sizeof (mreq));
+  inet_aton (NATPMP_ANNOUNCE_GROUP, &mreq.imr_multiaddr);
+  mreq.imr_interface.s_addr = htonl (INADDR_ANY);
+  if (bind (listenFd, (struct sockaddr *) &addr, sizeof (addr)) < 0
+      || setsockopt (listenFd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                     &mreq, sizeof (mreq)) < 0)
+  {
+    debug("Failed to listen for gateway announcements: %s\n",
+          strerror (errno));
+    close (listenFd);
+    listenFd = -1;
+    return FALSE;
+  }
+  fcntl (listenFd, F_SETFL, fcntl (listenFd, F_GETFL) | O_NONBLOCK);
+  fcntl (listenFd, F_SETFD, FD_CLOEXEC);
+
+  channel = g_io_channel_unix_new (listenFd);
+  listenWatch = g_io_add_watch (channel, G_IO_IN, listen_event, NULL);
+  g_io_channel_unref (channel);
+  return TRUE;
+}
+
+void gateway_unlisten ()
+{
+  if (listenFd < 0)
+    return;
+  g_source_remove (listenWatch);
+  close (listenFd);
+  listenFd = -1;
+}
@@ -0,0 +1,95 @@
+/*
+ *  Domain_check:
+ *  External ip address from the local gateway over NAT-PMP.
+ *
+ *  Copyright (C) 2016 Tommy Skagemo-Andreassen
+ *
+ *  This program is free software which I release under the GNU General Public
+ *  License. You may redistribute and/or modify this program under the terms
+ *  of that license as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include <glib.h>
+#include <netinet/in.h>
+
+/*
+ * Result of a request.
+ */
+enum
+{
+  GATEWAY_OK = 0,
+  GATEWAY_NO_GATEWAY,   /* No default route, and no gateway set */
+  GATEWAY_UNSUPPORTED,  /* Gateway answered, but won't tell the address,
+                           or it isn't a public one */
+  GATEWAY_FAILED,       /* Send failed, or port unreachable */
+  GATEWAY_TIMEOUT       /* No answer within the timeout */
+};
+
+typedef struct _GatewayQuery GatewayQuery;
+
+typedef void (*GatewayCallback) (GatewayQuery *query, gpointer data);
+
+/*
+ * Called with the new external ip address when the gateway announces
+ * that it changed.
+ */
+typedef void (*GatewayAnnounceCallback) (struct in_addr addr, gpointer data);
+
+struct _GatewayQuery
+{
+  gint           status;
+  struct in_addr gateway;
+  struct in_addr addr;        /* External ip address when GATEWAY_OK */
+  gint           latency_ms;
+
+  /* Private */
+  GatewayCallback callback;
+  gpointer        data;
+  gint            fd;
+  guint           watch;
+  guint           resend;
+  gint            interval;   /* Current resend interval in ms */
+  gint64          started;
+};
+
+/*
+ * Address to ask instead of the default gateway, NULL or 0 for the
+ * default gateway from the routing table.
+ */
+void gateway_set_address (const struct in_addr *addr);
+
+/*
+ * Give up on a request after timeout_ms.
+ */
+void gateway_set_timeout (gint timeout_ms);
+
+/*
+ * Ask the gateway for the external ip address.  The callback is called
+ * once from the main loop, unless the request is cancelled first.  The
+ * query is freed when the callback returns.
+ */
+GatewayQuery *gateway_lookup (GatewayCallback callback, gpointer data);
+
+/*
+ * Drop a request that has not completed yet, its callback is not called.
+ */
+void gateway_cancel (GatewayQuery *query);
+
+/*
+ * Listen for the external address change announcements the gateway
+ * multicasts to 224.0.0.1.  Only one listener at a time.
+ */
+gboolean gateway_listen (GatewayAnnounceCallback callback, gpointer data);
+
+void gateway_unlisten (void);
+
+#endif
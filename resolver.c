@@ -0,0 +1,1851 @@
+/*
+ *  Domain_check:
+ *  Non blocking DNS lookups driven from the GLib main loop.
+ *
+ *  gethostbyname() blocks GKrellM for as long as the resolver library
+ *  likes, and can't be given up on.  These lookups send A queries over
+ *  UDP from one socket watched by the main loop, so any number of them
+ *  can be pending, each has a timeout, and a pending one can be
+ *  cancelled at any time.
+ *
+ *  So that a long domain list doesn't trip the rate limits of public
+ *  resolvers, each upstream server has a cap on queries in flight and a
+ *  token bucket limiting the query rate.  Queries over the limits wait in
+ *  a queue per zone, and the zones with queries waiting take turns.
+ *
+ *  Many domains are CNAMEs to the same host, and a name may be checked
+ *  more than once.  Lookups follow CNAME chains themselves, every link
+ *  of a chain and every final answer is cached for its TTL, and lookups
+ *  of a name already being asked wait for that request instead of
+ *  sending another.  So each name is asked at most once per TTL.
+ *
+ *  For very long lists queries can instead go over a small pool of TCP
+ *  connections to each server, many of them pipelined on each connection
+ *  and answered in any order (RFC 7766).  The connections stay open for
+ *  the next checks until the server closes them.  An answer truncated
+ *  over UDP is asked again over TCP.
+ *
+ *  A lookup may go to any server of its set, the nameservers of
+ *  /etc/resolv.conf or the ones the caller gives.  Each server keeps a
+ *  smoothed round trip time of its answers, pushed up by the queries it
+ *  leaves unanswered, and queries go to the fastest server of the set.
+ *  The others are sent a query now and then so that a server that got
+ *  faster is noticed, and a server that keeps timing out is left alone
+ *  for a while.
+ *
+ *  Copyright (C) 2016 Tommy Skagemo-Andreassen
+ *
+ *  This program is free software which I release under the GNU General Public
+ *  License. You may redistribute and/or modify this program under the terms
+ *  of that license as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "domain_check.h"
+#include "resolver.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define RESOLV_CONF "/etc/resolv.conf"
+#define RESOLVER_MAX_SERVERS 4
+#define RESOLVER_ATTEMPTS 2
+#define RESOLVER_TICK 50
+
+#define RESOLVER_MAX_IN_FLIGHT 64
+#define RESOLVER_RATE 100
+#define RESOLVER_BURST 20
+
+/*
+ * Records of one answer looked at, and how often expired cache
+ * entries are swept out, in seconds.
+ */
+#define RESOLVER_MAX_RECORDS 32
+#define RESOLVER_SWEEP_INTERVAL 60
+
+/*
+ * Answers move the round trip time of a server 1/RESOLVER_SRTT_WEIGHT
+ * of the way to their own.  After RESOLVER_DEMOTE_FAILURES timeouts in
+ * a row a server is demoted for RESOLVER_DEMOTE_TIME seconds, doubled
+ * for each timeout after that up to RESOLVER_DEMOTE_MAX.  Servers not
+ * picked for RESOLVER_PROBE_INTERVAL seconds get the next query.
+ */
+#define RESOLVER_SRTT_WEIGHT 8
+#define RESOLVER_DEMOTE_FAILURES 3
+#define RESOLVER_DEMOTE_TIME 30
+#define RESOLVER_DEMOTE_MAX 600
+#define RESOLVER_PROBE_INTERVAL 60
+
+#define DNS_PORT 53
+#define DNS_MAX_PACKET 512
+#define DNS_MAX_TCP_PACKET 65535
+#define DNS_MAX_NAME 255
+#define DNS_HEADER_SIZE 12
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
+#define DNS_CLASS_IN 1
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+#define DNS_RCODE_NXDOMAIN 3
+
+/*
+ * Requests to one zone, the last two labels of the name, at one upstream.
+ */
+typedef struct
+{
+  gchar   *name;
+  GQueue  waiting;
+  gint    in_flight;
+  GList   ready_link;    /* In upstream->ready while requests are waiting */
+} ResolverZone;
+
+typedef struct
+{
+  struct in_addr addr;
+  GQueue     connections;
+  gint       in_flight;
+  gdouble    tokens;
+  gint64     refilled;
+  GHashTable *zones;     /* Zone name -> ResolverZone */
+  GQueue     ready;      /* Zones with waiting requests, in turn */
+  gint       queued;
+  gint       max_queued;
+  guint64    sent;
+  guint64    throttled;
+  gint64     srtt;       /* Smoothed round trip time in us, 0 until known */
+  gint       failures;   /* Timeouts since the last answer */
+  gint64     demoted;    /* Not picked until then */
+  gint64     picked;     /* Last picked for a query */
+  guint64    answers;
+  guint64    timeouts;
+} ResolverUpstream;
+
+/*
+ * Servers a lookup may be asked at.
+ */
+struct _ResolverSet
+{
+  gchar          *key;       /* As given to resolver_lookup(), "" for resolv.conf */
+  struct in_addr servers[RESOLVER_MAX_SERVERS];
+  gint           n_servers;
+};
+
+/*
+ * A TCP connection to an upstream, carrying any number of queries.
+ */
+typedef struct
+{
+  ResolverUpstream *upstream;
+  gint         fd;
+  guint        watch;
+  GIOCondition condition;   /* Of the watch */
+  gboolean     connected;
+  GString      *out;        /* Length prefixed queries not written yet */
+  GString      *in;         /* Answers read, not yet whole */
+  gint         pending;     /* Requests waiting for an answer on it */
+  GList        link;        /* In upstream->connections */
+} ResolverConnection;
+
+/*
+ * One question on the wire.  Every lookup waiting for the same name at
+ * the same server shares it.
+ */
+struct _ResolverRequest
+{
+  gchar             *key;           /* See request_key() */
+  gchar             *name;
+  ResolverSet       *set;
+  guint16           id;             /* 0 until first sent */
+  struct in_addr    sent_to;        /* Server of the last attempt */
+  gint              attempts;
+  gint              failed;         /* Attempts counted as timeouts */
+  gint64            started;        /* First sent, 0 while queued */
+  gint64            sent;
+  guchar            *packet;
+  gint              packet_len;
+  gint              status;
+  gboolean          tcp;            /* Sent over TCP */
+  gboolean          truncated;      /* UDP answer had TC set */
+  ResolverConnection *connection;   /* TCP connection sent on, if any */
+  ResolverUpstream  *upstream;      /* Upstream whose limits it counts in */
+  ResolverZone      *zone;
+  GList             wait_link;      /* In zone->waiting while queued */
+  GQueue            waiters;        /* Lookups waiting for the answer */
+  gboolean          completing;     /* Off the wire, waiters being run */
+  gboolean          no_id;          /* Failed for want of a free id */
+};
+
+/*
+ * What is known about a name: the CNAME it points to, or the final
+ * answer.  Good until expires, in monotonic time.
+ */
+typedef struct
+{
+  gchar   *key;
+  gchar   *target;
+  gint    status;
+  guint32 addrs[RESOLVER_MAX_ADDRS];
+  gint    n_addrs;
+  gint64  expires;
+} ResolverEntry;
+
+/*
+ * Server sets by key, the one of /etc/resolv.conf read on its first lookup
+ * and again by resolver_reload() when the file has changed since.
+ */
+static GHashTable *sets;
+static time_t resolvConfMtime;
+static gchar *defaultServers;    /* Used instead of resolv.conf when set */
+
+static gint socketFd = -1;
+static guint socketWatch;
+static guint tickTimeout;
+static guint doneIdle;
+
+/*
+ * Requests on the wire by DNS id, and every pending request, queued or
+ * sent, by key.
+ */
+static GHashTable *requestIds;
+static GHashTable *requests;
+
+/*
+ * Lookups not completed yet, and the ones answered without a request,
+ * whose callbacks are run from an idle callback.
+ */
+static GHashTable *queries;
+static GQueue done;
+
+static GHashTable *cache;
+static gint64 cacheSwept;
+static ResolverCacheStats cacheStats;
+
+static gint lookupTimeout = 2000;
+static gint maxInFlight = RESOLVER_MAX_IN_FLIGHT;
+static gint rateLimit = RESOLVER_RATE;
+static gint burstLimit = RESOLVER_BURST;
+static gint tcpConnections;
+
+/*
+ * Upstream servers by address, created when first used.
+ */
+static GHashTable *upstreams;
+
+
+static void read_resolv_conf (ResolverSet *set)
+{
+  FILE        *f;
+  gchar       line[256];
+  gchar       address[64];
+  struct stat st;
+
+  resolvConfMtime = stat (RESOLV_CONF, &st) == 0 ? st.st_mtime : 0;
+  set->n_servers = 0;
+  f = fopen (RESOLV_CONF, "r");
+  if (f)
+  {
+    while (fgets (line, sizeof (line), f) && set->n_servers < RESOLVER_MAX_SERVERS)
+    {
+      if (sscanf (line, "nameserver %63s", address) == 1
+          && inet_aton (address, &set->servers[set->n_servers]))
+      {
+        debug("Nameserver %s\n", address);
+        set->n_servers += 1;
+      }
+    }
+    fclose (f);
+  }
+
+  /*
+   * Same default as the resolver library.
+   */
+  if (set->n_servers == 0)
+  {
+    inet_aton ("127.0.0.1", &set->servers[0]);
+    set->n_servers = 1;
+  }
+}
+
+static void free_set (ResolverSet *set)
+{
+  g_free (set->key);
+  g_free (set);
+}
+
+/*
+ * The set of the space separated addresses in servers, or of
+ * resolv.conf when it is NULL.  Returns NULL if none can be parsed.
+ */
+static ResolverSet *get_set (const gchar *servers)
+{
+  ResolverSet *set;
+  gchar       **addresses;
+  gint        i;
+
+  if (!servers)
+    servers = defaultServers;
+  if (!sets)
+    sets = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                  (GDestroyNotify) free_set);
+  set = g_hash_table_lookup (sets, servers ? servers : "");
+  if (set)
+    return set;
+
+  set = g_new0 (ResolverSet, 1);
+  set->key = g_strdup (servers ? servers : "");
+  if (servers)
+  {
+    addresses = g_strsplit (servers, " ", 0);
+    for (i = 0; addresses[i] && set->n_servers < RESOLVER_MAX_SERVERS; i += 1)
+      if (inet_aton (addresses[i], &set->servers[set->n_servers]))
+        set->n_servers += 1;
+    g_strfreev (addresses);
+  }
+  else
+  {
+    read_resolv_conf (set);
+  }
+  if (set->n_servers == 0)
+  {
+    free_set (set);
+    return NULL;
+  }
+  g_hash_table_insert (sets, set->key, set);
+  return set;
+}
+
+void resolver_set_servers (const gchar *servers)
+{
+  g_free (defaultServers);
+  defaultServers = servers ? g_strdup (servers) : NULL;
+}
+
+void resolver_reload (void)
+{
+  ResolverSet *set;
+  struct stat st;
+
+  set = sets ? g_hash_table_lookup (sets, "") : NULL;
+  if (!set)
+    return;
+  if ((stat (RESOLV_CONF, &st) == 0 ? st.st_mtime : 0) == resolvConfMtime)
+    return;
+
+  /*
+   * The set is changed in place, requests already sent keep it.  An answer
+   * from a server no longer listed is ignored, the request is sent again
+   * to one of the new servers.
+   */
+  read_resolv_conf (set);
+}
+
+static gboolean is_server (const struct sockaddr_in *from,
+                           ResolverRequest *request)
+{
+  gint i;
+
+  if (ntohs (from->sin_port) != DNS_PORT)
+    return FALSE;
+  for (i = 0; i < request->set->n_servers; i += 1)
+    if (from->sin_addr.s_addr == request->set->servers[i].s_addr)
+      return TRUE;
+  return FALSE;
+}
+
+/*
+ * Build the query packet for the A records of request->name.
+ */
+static gboolean build_query (ResolverRequest *request)
+{
+  guchar *p;
+  gchar  *label;
+  gchar  *dot;
+  gsize  len;
+
+  len = strlen (request->name);
+  if (len == 0 || len > DNS_MAX_NAME - 2)
+    return FALSE;
+
+  request->packet = g_malloc0 (DNS_HEADER_SIZE + len + 2 + 4);
+  p = request->packet;
+  p[2] = DNS_FLAG_RD >> 8;
+  p[5] = 1;                    /* One question */
+  p += DNS_HEADER_SIZE;
+
+  for (label = request->name; *label; label = dot + 1)
+  {
+    dot = strchr (label, '.');
+    if (!dot)
+      dot = label + strlen (label);
+    len = dot - label;
+    if (len == 0 || len > 63)
+      return FALSE;
+    *p++ = len;
+    memcpy (p, label, len);
+    p += len;
+    if (!*dot)
+      break;
+  }
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = DNS_TYPE_A;
+  *p++ = 0;
+  *p++ = DNS_CLASS_IN;
+  request->packet_len = p - request->packet;
+  return TRUE;
+}
+
+/*
+ * Read a possibly compressed name at *offset into name, and move *offset
+ * past it.
+ */
+static gboolean read_name (const guchar *buf, gint len, gint *offset,
+                           gchar *name)
+{
+  gint pos = *offset;
+  gint out = 0;
+  gint jumps = 0;
+  gint n;
+
+  while (pos < len)
+  {
+    n = buf[pos];
+    if ((n & 0xc0) == 0xc0)
+    {
+      if (pos + 1 >= len || ++jumps > 16)
+        return FALSE;
+      if (jumps == 1)
+        *offset = pos + 2;
+      pos = ((n & 0x3f) << 8) | buf[pos + 1];
+      continue;
+    }
+    if (n == 0)
+    {
+      if (jumps == 0)
+        *offset = pos + 1;
+      if (out > 0)
+        out -= 1;             /* Trailing dot */
+      name[out] = '\0';
+      return TRUE;
+    }
+    if (pos + 1 + n > len || out + n + 1 > DNS_MAX_NAME)
+      return FALSE;
+    memcpy (name + out, buf + pos + 1, n);
+    out += n;
+    name[out++] = '.';
+    pos += 1 + n;
+  }
+  return FALSE;
+}
+
+static guint32 read_u32 (const guchar *p)
+{
+  return ((guint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * Cache entries and requests are found by server set and lower case
+ * name, as the answer for myip.opendns.com at OpenDNS is not the answer
+ * at the local resolver.
+ */
+static gchar *request_key (ResolverSet *set, const gchar *name)
+{
+  gchar *lower;
+  gchar *key;
+
+  lower = g_ascii_strdown (name, -1);
+  key = g_strdup_printf ("%s/%s", set->key, lower);
+  g_free (lower);
+  return key;
+}
+
+static void free_entry (ResolverEntry *entry)
+{
+  g_free (entry->key);
+  g_free (entry->target);
+  g_free (entry);
+}
+
+static ResolverEntry *cache_put (ResolverSet *set, const gchar *name,
+                                 guint32 ttl, gint64 now)
+{
+  ResolverEntry *entry;
+
+  if (!cache)
+    cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                   (GDestroyNotify) free_entry);
+  entry = g_new0 (ResolverEntry, 1);
+  entry->key = request_key (set, name);
+  entry->expires = now + (gint64) ttl * G_USEC_PER_SEC;
+  g_hash_table_replace (cache, entry->key, entry);
+  return entry;
+}
+
+/*
+ * An entry is good up to and including the time it expires, so records
+ * with a TTL of 0 still answer the lookups waiting for them.
+ */
+static ResolverEntry *cache_get (ResolverSet *set, const gchar *name,
+                                 gint64 now)
+{
+  ResolverEntry *entry;
+  gchar         *key;
+
+  if (!cache)
+    return NULL;
+  key = request_key (set, name);
+  entry = g_hash_table_lookup (cache, key);
+  g_free (key);
+  if (entry && entry->expires < now)
+  {
+    g_hash_table_remove (cache, entry->key);
+    entry = NULL;
+  }
+  return entry;
+}
+
+static gboolean entry_expired (gpointer key, gpointer value, gpointer data)
+{
+  return ((ResolverEntry *) value)->expires < *(gint64 *) data;
+}
+
+static void cache_sweep (gint64 now)
+{
+  if (!cache || now - cacheSwept < RESOLVER_SWEEP_INTERVAL * G_USEC_PER_SEC)
+    return;
+  cacheSwept = now;
+  g_hash_table_foreach_remove (cache, entry_expired, &now);
+}
+
+/*
+ * Parse an answer to request, and cache what it says about the name and
+ * the CNAME chain from it.  Returns FALSE if the packet is not an answer
+ * to it.
+ */
+static gboolean parse_answer (const guchar *buf, gint len,
+                              ResolverRequest *request, gint64 now)
+{
+  gchar         name[DNS_MAX_NAME + 1];
+  gchar         owner[RESOLVER_MAX_RECORDS][DNS_MAX_NAME + 1];
+  gchar         target[RESOLVER_MAX_RECORDS][DNS_MAX_NAME + 1];
+  gint          type[RESOLVER_MAX_RECORDS];
+  guint32       ttl[RESOLVER_MAX_RECORDS];
+  guint32       addr[RESOLVER_MAX_RECORDS];
+  const gchar   *current;
+  ResolverEntry *entry;
+  gint          offset = DNS_HEADER_SIZE;
+  gint          flags;
+  gint          rcode;
+  gint          count;
+  gint          n = 0;
+  gint          rtype;
+  gint          class;
+  gint          rdlength;
+  gint          links;
+  gint          i;
+  guint32       rttl;
+  guint32       min_ttl;
+  guint32       negative_ttl = 0;
+
+  if (len < DNS_HEADER_SIZE)
+    return FALSE;
+  flags = (buf[2] << 8) | buf[3];
+  rcode = flags & 0xf;
+  if (!(flags & DNS_FLAG_QR) || ((buf[4] << 8) | buf[5]) != 1)
+    return FALSE;
+
+  /*
+   * The question has to be ours.
+   */
+  if (!read_name (buf, len, &offset, name) || offset + 4 > len
+      || g_ascii_strcasecmp (name, request->name))
+    return FALSE;
+  offset += 4;
+
+  if ((flags & DNS_FLAG_TC) || (rcode && rcode != DNS_RCODE_NXDOMAIN))
+  {
+    request->truncated = (flags & DNS_FLAG_TC) != 0;
+    request->status = RESOLVE_FAILED;
+    return TRUE;
+  }
+
+  /*
+   * Collect the CNAME and A records of the answer section, and the SOA
+   * of the authority section, which gives the TTL of a negative answer.
+   */
+  count = ((buf[6] << 8) | buf[7]) + ((buf[8] << 8) | buf[9]);
+  while (count-- > 0 && n < RESOLVER_MAX_RECORDS)
+  {
+    if (!read_name (buf, len, &offset, owner[n]) || offset + 10 > len)
+      break;
+    rtype = (buf[offset] << 8) | buf[offset + 1];
+    class = (buf[offset + 2] << 8) | buf[offset + 3];
+    rttl = read_u32 (buf + offset + 4);
+    rdlength = (buf[offset + 8] << 8) | buf[offset + 9];
+    offset += 10;
+    if (offset + rdlength > len)
+      break;
+    if (class == DNS_CLASS_IN && rtype == DNS_TYPE_A && rdlength == 4)
+    {
+      memcpy (&addr[n], buf + offset, 4);
+      type[n] = rtype;
+      ttl[n++] = rttl;
+    }
+    else if (class == DNS_CLASS_IN && rtype == DNS_TYPE_CNAME)
+    {
+      i = offset;
+      if (read_name (buf, len, &i, target[n]))
+      {
+        type[n] = rtype;
+        ttl[n++] = rttl;
+      }
+    }
+    else if (rtype == DNS_TYPE_SOA && rdlength >= 22)
+    {
+      /* The SOA minimum is the last field of its data */
+      negative_ttl = MIN (read_u32 (buf + offset + rdlength - 4), rttl);
+    }
+    offset += rdlength;
+  }
+
+  /*
+   * Follow the chain from the name asked for, caching each link.
+   */
+  current = request->name;
+  for (links = 0; links < RESOLVER_MAX_CHAIN; links += 1)
+  {
+    for (i = 0; i < n; i += 1)
+      if (type[i] == DNS_TYPE_CNAME && !g_ascii_strcasecmp (owner[i], current))
+        break;
+    if (i == n)
+      break;
+    entry = cache_put (request->set, current, ttl[i], now);
+    entry->target = g_strdup (target[i]);
+    current = target[i];
+  }
+
+  /*
+   * The A records of the end of the chain are the answer.
+   */
+  entry = NULL;
+  min_ttl = G_MAXUINT32;
+  for (i = 0; i < n; i += 1)
+  {
+    if (type[i] != DNS_TYPE_A || g_ascii_strcasecmp (owner[i], current))
+      continue;
+    if (!entry)
+      entry = cache_put (request->set, current, 0, now);
+    if (entry->n_addrs < RESOLVER_MAX_ADDRS)
+      entry->addrs[entry->n_addrs++] = addr[i];
+    min_ttl = MIN (min_ttl, ttl[i]);
+  }
+  if (entry)
+  {
+    entry->status = RESOLVE_OK;
+    entry->expires = now + (gint64) min_ttl * G_USEC_PER_SEC;
+  }
+  else if (rcode == DNS_RCODE_NXDOMAIN)
+  {
+    entry = cache_put (request->set, current, negative_ttl, now);
+    entry->status = RESOLVE_NXDOMAIN;
+  }
+  else if (current == request->name)
+  {
+    entry = cache_put (request->set, current, negative_ttl, now);
+    entry->status = RESOLVE_NODATA;
+  }
+
+  /*
+   * Otherwise the server gave the CNAME without following it, and the
+   * lookups waiting ask for the target themselves.
+   */
+  request->status = RESOLVE_OK;
+  return TRUE;
+}
+
+static ResolverUpstream *get_upstream (struct in_addr addr)
+{
+  ResolverUpstream *upstream;
+
+  if (!upstreams)
+    upstreams = g_hash_table_new (g_direct_hash, g_direct_equal);
+  upstream = g_hash_table_lookup (upstreams, GUINT_TO_POINTER (addr.s_addr));
+  if (!upstream)
+  {
+    upstream = g_new0 (ResolverUpstream, 1);
+    upstream->addr = addr;
+    upstream->tokens = burstLimit;
+    upstream->refilled = g_get_monotonic_time ();
+    upstream->zones = g_hash_table_new (g_str_hash, g_str_equal);
+    g_hash_table_insert (upstreams, GUINT_TO_POINTER (addr.s_addr), upstream);
+  }
+  return upstream;
+}
+
+static void refill_tokens (ResolverUpstream *upstream)
+{
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  upstream->tokens = MIN (upstream->tokens
+                          + (now - upstream->refilled) * rateLimit / 1e6,
+                          burstLimit);
+  upstream->refilled = now;
+}
+
+static gboolean take_token (ResolverUpstream *upstream)
+{
+  refill_tokens (upstream);
+  if (upstream->tokens < 1.0)
+    return FALSE;
+  upstream->tokens -= 1.0;
+  return TRUE;
+}
+
+/*
+ * An answer came from upstream rtt us after the query was sent, or rtt
+ * is 0 when the answer is to an earlier attempt and can't be timed.
+ */
+static void upstream_answered (ResolverUpstream *upstream, gint64 rtt)
+{
+  upstream->answers += 1;
+  upstream->failures = 0;
+  upstream->demoted = 0;
+  if (rtt <= 0)
+    return;
+  if (upstream->srtt == 0)
+    upstream->srtt = rtt;
+  else
+    upstream->srtt += (rtt - upstream->srtt) / RESOLVER_SRTT_WEIGHT;
+}
+
+/*
+ * A query to upstream went unanswered.  It counts as an answer taking
+ * the whole lookup timeout, weighing more than a real answer does, so a
+ * server dropping some of the queries soon looks slower than the others.
+ */
+static void upstream_failed (ResolverUpstream *upstream, gint64 now)
+{
+  gint64 timeout;
+  gint   doublings;
+
+  timeout = (gint64) lookupTimeout * 1000;
+  upstream->timeouts += 1;
+  upstream->failures += 1;
+  upstream->srtt += (timeout - upstream->srtt) / 2;
+  if (upstream->failures >= RESOLVER_DEMOTE_FAILURES)
+  {
+    doublings = MIN (upstream->failures - RESOLVER_DEMOTE_FAILURES, 8);
+    upstream->demoted = now + MIN ((gint64) RESOLVER_DEMOTE_TIME << doublings,
+                                   RESOLVER_DEMOTE_MAX) * G_USEC_PER_SEC;
+    debug("Nameserver %s demoted after %d timeouts\n",
+          inet_ntoa (upstream->addr), upstream->failures);
+  }
+}
+
+/*
+ * The server of set to send a query to: one not picked for
+ * RESOLVER_PROBE_INTERVAL seconds, so that every server keeps a current
+ * round trip time, or else the fastest.  A server not timed yet only
+ * gets that one query until it answers, unless none is timed.  Demoted
+ * servers are only picked when all of them are, the one whose demotion
+ * ends first.  exclude, the server the last attempt went to, is skipped
+ * if the set has others.
+ */
+static ResolverUpstream *pick_upstream (ResolverSet *set,
+                                        struct in_addr exclude, gint64 now)
+{
+  ResolverUpstream *upstream;
+  ResolverUpstream *fastest = NULL;
+  ResolverUpstream *stale = NULL;
+  ResolverUpstream *demoted = NULL;
+  gint             i;
+
+  for (i = 0; i < set->n_servers; i += 1)
+  {
+    if (set->n_servers > 1 && set->servers[i].s_addr == exclude.s_addr)
+      continue;
+    upstream = get_upstream (set->servers[i]);
+    if (upstream->demoted > now)
+    {
+      if (!demoted || upstream->demoted < demoted->demoted)
+        demoted = upstream;
+      continue;
+    }
+    if (!stale && now - upstream->picked >= RESOLVER_PROBE_INTERVAL * G_USEC_PER_SEC)
+      stale = upstream;
+    if (!fastest || (upstream->srtt
+                     && (!fastest->srtt || upstream->srtt < fastest->srtt)))
+      fastest = upstream;
+  }
+  upstream = stale ? stale : fastest ? fastest : demoted;
+  upstream->picked = now;
+  return upstream;
+}
+
+/*
+ * Time the answer to request from addr, if it answers the last attempt.
+ */
+static void request_answered (ResolverRequest *request, struct in_addr addr,
+                              gint64 now)
+{
+  upstream_answered (get_upstream (addr),
+                     request->sent && addr.s_addr == request->sent_to.s_addr
+                     ? now - request->sent : 0);
+}
+
+/*
+ * The last attempt of request went unanswered, count it against its
+ * server once.
+ */
+static void request_failed (ResolverRequest *request, gint64 now)
+{
+  if (request->failed == request->attempts || !request->sent_to.s_addr)
+    return;
+  request->failed = request->attempts;
+  upstream_failed (get_upstream (request->sent_to), now);
+}
+
+static ResolverZone *get_zone (ResolverUpstream *upstream, const gchar *name)
+{
+  ResolverZone *zone;
+  const gchar  *p;
+
+  /*
+   * The zone is approximated by the last two labels.
+   */
+  p = name + strlen (name);
+  while (p > name && *(p - 1) != '.')
+    p -= 1;
+  if (p > name)
+  {
+    p -= 1;
+    while (p > name && *(p - 1) != '.')
+      p -= 1;
+  }
+
+  zone = g_hash_table_lookup (upstream->zones, p);
+  if (!zone)
+  {
+    zone = g_new0 (ResolverZone, 1);
+    zone->name = g_strdup (p);
+    zone->ready_link.data = zone;
+    g_hash_table_insert (upstream->zones, zone->name, zone);
+  }
+  return zone;
+}
+
+static void release_zone (ResolverUpstream *upstream, ResolverZone *zone)
+{
+  if (zone->in_flight == 0 && g_queue_is_empty (&zone->waiting))
+  {
+    g_hash_table_remove (upstream->zones, zone->name);
+    g_free (zone->name);
+    g_free (zone);
+  }
+}
+
+static void free_query (ResolverQuery *query)
+{
+  gint i;
+
+  for (i = 0; i < query->chain_len; i += 1)
+    g_free (query->chain[i]);
+  g_free (query->name);
+  g_free (query);
+}
+
+static void free_request (ResolverRequest *request)
+{
+  g_free (request->key);
+  g_free (request->name);
+  g_free (request->packet);
+  g_free (request);
+}
+
+static void dispatch (ResolverUpstream *upstream);
+static void resolve (ResolverQuery *query, gint64 now, gboolean later);
+static void complete_request (ResolverRequest *request, gint64 now);
+
+/*
+ * Take the request out of its upstream's queue or in-flight count.
+ */
+static void detach_request (ResolverRequest *request)
+{
+  ResolverUpstream *upstream = request->upstream;
+  ResolverZone     *zone = request->zone;
+
+  if (!upstream)
+    return;
+  if (request->started)
+  {
+    upstream->in_flight -= 1;
+    zone->in_flight -= 1;
+  }
+  else
+  {
+    g_queue_unlink (&zone->waiting, &request->wait_link);
+    upstream->queued -= 1;
+    if (g_queue_is_empty (&zone->waiting))
+      g_queue_unlink (&upstream->ready, &zone->ready_link);
+  }
+  release_zone (upstream, zone);
+  request->upstream = NULL;
+  request->zone = NULL;
+}
+
+/*
+ * Take the request off the wire.  The caller deals with its waiters.
+ */
+static void drop_request (ResolverRequest *request)
+{
+  if (request->id)
+    g_hash_table_remove (requestIds, GUINT_TO_POINTER (request->id));
+  g_hash_table_remove (requests, request->key);
+  detach_request (request);
+  if (request->connection)
+  {
+    request->connection->pending -= 1;
+    request->connection = NULL;
+  }
+  request->completing = TRUE;
+}
+
+/*
+ * Run the callback of a lookup that has its answer.
+ */
+static void complete_query (ResolverQuery *query)
+{
+  g_hash_table_remove (queries, query);
+  query->latency_ms = (g_get_monotonic_time () - query->started) / 1000;
+  debug("Lookup %s: status %d, %d addresses, %d links, %d ms\n", query->name,
+        query->status, query->n_addrs, query->chain_len, query->latency_ms);
+  query->callback (query, query->data);
+  free_query (query);
+}
+
+static gboolean run_done (gpointer data)
+{
+  doneIdle = 0;
+  while (!g_queue_is_empty (&done))
+    complete_query (g_queue_pop_head (&done));
+  return FALSE;
+}
+
+/*
+ * Complete a lookup now, or from an idle callback when it was answered
+ * from the cache inside resolver_lookup(), whose caller doesn't expect
+ * the callback yet.
+ */
+static void finish_query (ResolverQuery *query, gboolean later)
+{
+  if (!later)
+  {
+    complete_query (query);
+    return;
+  }
+  g_queue_push_tail (&done, query);
+  if (!doneIdle)
+    doneIdle = g_idle_add (run_done, NULL);
+}
+
+/*
+ * Lookups waiting for a request that was dropped carry on from the
+ * cache, or fail with it.  Callbacks may start or cancel lookups, so the
+ * waiters are taken one at a time and the request is only freed once it
+ * has none left.
+ */
+static void finish_request (ResolverRequest *request, gint64 now)
+{
+  ResolverQuery *query;
+
+  while (!g_queue_is_empty (&request->waiters))
+  {
+    query = g_queue_pop_head (&request->waiters);
+    query->request = NULL;
+    if (request->status == RESOLVE_OK)
+    {
+      resolve (query, now, FALSE);
+    }
+    else
+    {
+      query->status = request->status;
+      complete_query (query);
+    }
+  }
+  free_request (request);
+}
+
+/*
+ * The request has an answer, or has failed.
+ */
+static void complete_request (ResolverRequest *request, gint64 now)
+{
+  ResolverUpstream *upstream = request->upstream;
+
+  drop_request (request);
+  finish_request (request, now);
+
+  /*
+   * A slot is free, send the next request waiting for it.
+   */
+  if (upstream)
+    dispatch (upstream);
+}
+
+static gboolean connection_event (GIOChannel *channel, GIOCondition cond,
+                                  gpointer data);
+
+/*
+ * Watch for writing only while connecting or there is something to write.
+ */
+static GIOCondition connection_condition (ResolverConnection *connection)
+{
+  if (!connection->connected || connection->out->len > 0)
+    return G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
+  return G_IO_IN | G_IO_HUP | G_IO_ERR;
+}
+
+static void connection_watch (ResolverConnection *connection)
+{
+  GIOChannel   *channel;
+  GIOCondition condition;
+
+  condition = connection_condition (connection);
+  if (connection->watch && condition == connection->condition)
+    return;
+  if (connection->watch)
+    g_source_remove (connection->watch);
+  channel = g_io_channel_unix_new (connection->fd);
+  connection->watch = g_io_add_watch (channel, condition,
+                                      connection_event, connection);
+  connection->condition = condition;
+  g_io_channel_unref (channel);
+}
+
+static void free_connection (ResolverConnection *connection)
+{
+  if (connection->watch)
+    g_source_remove (connection->watch);
+  close (connection->fd);
+  g_queue_unlink (&connection->upstream->connections, &connection->link);
+  g_string_free (connection->out, TRUE);
+  g_string_free (connection->in, TRUE);
+  g_free (connection);
+}
+
+/*
+ * The connection failed or the server closed it.  Requests still
+ * waiting on it are sent again from the next tick if they have attempts
+ * left, otherwise they time out.
+ */
+static void close_connection (ResolverConnection *connection)
+{
+  GHashTableIter  iter;
+  ResolverRequest *request;
+
+  debug("Closing TCP connection to %s, %d pending\n",
+        inet_ntoa (connection->upstream->addr), connection->pending);
+  g_hash_table_iter_init (&iter, requestIds);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &request))
+  {
+    if (request->connection == connection)
+    {
+      request->connection = NULL;
+      request->sent = 0;
+    }
+  }
+  free_connection (connection);
+}
+
+static ResolverConnection *open_connection (ResolverUpstream *upstream)
+{
+  ResolverConnection *connection;
+  struct sockaddr_in to;
+  gint               fd;
+  gint               on = 1;
+
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return NULL;
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+  /*
+   * Queries are small and written as soon as they are made.
+   */
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+
+  memset (&to, 0, sizeof (to));
+  to.sin_family = AF_INET;
+  to.sin_port = htons (DNS_PORT);
+  to.sin_addr = upstream->addr;
+  if (connect (fd, (struct sockaddr *) &to, sizeof (to)) < 0
+      && errno != EINPROGRESS)
+  {
+    debug("Failed to connect to %s: %s\n", inet_ntoa (upstream->addr),
+          strerror (errno));
+    close (fd);
+    return NULL;
+  }
+
+  connection = g_new0 (ResolverConnection, 1);
+  connection->upstream = upstream;
+  connection->fd = fd;
+  connection->out = g_string_new (NULL);
+  connection->in = g_string_new (NULL);
+  connection->link.data = connection;
+  g_queue_push_tail_link (&upstream->connections, &connection->link);
+  connection_watch (connection);
+  return connection;
+}
+
+/*
+ * Handle the whole answers read so far.
+ */
+static void connection_answers (ResolverConnection *connection)
+{
+  ResolverRequest *request;
+  guchar          *buf;
+  gint64          now;
+  guint           len;
+  guint16         id;
+
+  while (connection->in->len >= 2)
+  {
+    buf = (guchar *) connection->in->str;
+    len = (buf[0] << 8) | buf[1];
+    if (connection->in->len < 2 + len)
+      break;
+
+    id = len >= DNS_HEADER_SIZE ? (buf[2] << 8) | buf[3] : 0;
+    now = g_get_monotonic_time ();
+    request = g_hash_table_lookup (requestIds, GUINT_TO_POINTER (id));
+    if (request && request->connection == connection
+        && parse_answer (buf + 2, len, request, now))
+    {
+      request_answered (request, connection->upstream->addr, now);
+      complete_request (request, now);
+    }
+    g_string_erase (connection->in, 0, 2 + len);
+  }
+}
+
+static gboolean connection_event (GIOChannel *channel, GIOCondition cond,
+                                  gpointer data)
+{
+  ResolverConnection *connection = data;
+  guchar             buf[4096];
+  gssize             n;
+  gint               error = 0;
+  socklen_t          errlen = sizeof (error);
+
+  if (!connection->connected && (cond & (G_IO_OUT | G_IO_ERR | G_IO_HUP)))
+  {
+    getsockopt (connection->fd, SOL_SOCKET, SO_ERROR, &error, &errlen);
+    if (error)
+    {
+      debug("Failed to connect to %s: %s\n",
+            inet_ntoa (connection->upstream->addr), strerror (error));
+      close_connection (connection);
+      return FALSE;
+    }
+    connection->connected = TRUE;
+  }
+
+  if ((cond & G_IO_OUT) && connection->out->len > 0)
+  {
+    n = send (connection->fd, connection->out->str, connection->out->len,
+              MSG_NOSIGNAL);
+    if (n > 0)
+      g_string_erase (connection->out, 0, n);
+  }
+
+  if (cond & (G_IO_IN | G_IO_HUP | G_IO_ERR))
+  {
+    for (;;)
+    {
+      n = recv (connection->fd, buf, sizeof (buf), 0);
+      if (n > 0)
+      {
+        g_string_append_len (connection->in, (gchar *) buf, n);
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+
+      /*
+       * Closed by the server, answers read before still count.
+       */
+      connection_answers (connection);
+      close_connection (connection);
+      return FALSE;
+    }
+    connection_answers (connection);
+  }
+
+  /*
+   * The watch is replaced if what it waits for changed.  Sending from
+   * the callbacks of the answers may have replaced it already.
+   */
+  if (connection_condition (connection) == connection->condition)
+    return TRUE;
+  connection_watch (connection);
+  return FALSE;
+}
+
+/*
+ * Pipeline the query on the connection to the upstream with the fewest
+ * answers pending, opening another while the pool isn't full and every
+ * connection is busy.
+ */
+static gboolean send_tcp (ResolverRequest *request, struct in_addr addr)
+{
+  ResolverUpstream   *upstream;
+  ResolverConnection *connection = NULL;
+  ResolverConnection *other;
+  GList              *list;
+  guchar             prefix[2];
+
+  upstream = get_upstream (addr);
+  for (list = upstream->connections.head; list; list = list->next)
+  {
+    other = list->data;
+    if (!connection || other->pending < connection->pending)
+      connection = other;
+  }
+  if (!connection || (connection->pending > 0
+                      && upstream->connections.length < MAX (tcpConnections, 1)))
+  {
+    other = open_connection (upstream);
+    if (other)
+      connection = other;
+  }
+  if (!connection)
+    return FALSE;
+
+  prefix[0] = request->packet_len >> 8;
+  prefix[1] = request->packet_len & 0xff;
+  g_string_append_len (connection->out, (gchar *) prefix, 2);
+  g_string_append_len (connection->out, (gchar *) request->packet,
+                       request->packet_len);
+  connection_watch (connection);
+  request->connection = connection;
+  connection->pending += 1;
+  return TRUE;
+}
+
+static void send_request (ResolverRequest *request, struct in_addr addr)
+{
+  struct sockaddr_in to;
+
+  memset (&to, 0, sizeof (to));
+  to.sin_family = AF_INET;
+  to.sin_port = htons (DNS_PORT);
+  to.sin_addr = addr;
+
+  request->attempts += 1;
+  request->sent = g_get_monotonic_time ();
+  request->sent_to = addr;
+  if (tcpConnections > 0)
+    request->tcp = TRUE;
+  if (request->tcp)
+  {
+    if (!send_tcp (request, addr))
+      debug("Failed to send query for %s over TCP\n", request->name);
+  }
+  else if (sendto (socketFd, request->packet, request->packet_len, 0,
+              (struct sockaddr *) &to, sizeof (to)) < 0)
+  {
+    debug("Failed to send query for %s: %s\n", request->name, strerror (errno));
+  }
+}
+
+/*
+ * Give the request a DNS id no other request on the wire has, and put
+ * it in the packet.  Ids are random, a few are tried before looking for
+ * any that is free.  Returns FALSE when all 65535 are taken.
+ */
+static gboolean assign_id (ResolverRequest *request)
+{
+  guint id;
+  guint i;
+
+  id = g_random_int_range (1, 0x10000);
+  for (i = 0; i < 0xffff + 8; i += 1)
+  {
+    if (!g_hash_table_lookup (requestIds, GUINT_TO_POINTER (id)))
+    {
+      request->id = id;
+      request->packet[0] = id >> 8;
+      request->packet[1] = id & 0xff;
+      g_hash_table_insert (requestIds, GUINT_TO_POINTER (id), request);
+      return TRUE;
+    }
+    id = i < 8 ? g_random_int_range (1, 0x10000) : id % 0xffff + 1;
+  }
+  return FALSE;
+}
+
+/*
+ * Send requests waiting at the upstream while it is under its limits.
+ * Zones take turns, and a zone may use at most half of the in-flight
+ * slots, so slow answers from one zone can't fill them all.
+ */
+static void dispatch (ResolverUpstream *upstream)
+{
+  ResolverZone    *zone;
+  ResolverRequest *request;
+  GList           *link;
+  gint            zone_limit;
+  guint           skipped = 0;
+
+  zone_limit = MAX (maxInFlight / 2, 1);
+  while (!g_queue_is_empty (&upstream->ready)
+         && upstream->in_flight < maxInFlight
+         && skipped < upstream->ready.length)
+  {
+    zone = g_queue_peek_head (&upstream->ready);
+    if (zone->in_flight >= zone_limit)
+    {
+      g_queue_unlink (&upstream->ready, &zone->ready_link);
+      g_queue_push_tail_link (&upstream->ready, &zone->ready_link);
+      skipped += 1;
+      continue;
+    }
+    if (!take_token (upstream))
+      break;
+    skipped = 0;
+
+    /*
+     * A request only takes an id when it goes out.  Without a free one
+     * it fails, and is completed from the next tick.
+     */
+    request = g_queue_peek_head (&zone->waiting);
+    if (!assign_id (request))
+    {
+      debug("No free DNS id for %s\n", request->name);
+      detach_request (request);
+      request->status = RESOLVE_FAILED;
+      request->no_id = TRUE;
+      continue;
+    }
+
+    link = g_queue_pop_head_link (&zone->waiting);
+    upstream->queued -= 1;
+    g_queue_unlink (&upstream->ready, &zone->ready_link);
+    if (!g_queue_is_empty (&zone->waiting))
+      g_queue_push_tail_link (&upstream->ready, &zone->ready_link);
+
+    upstream->in_flight += 1;
+    upstream->sent += 1;
+    zone->in_flight += 1;
+    request->started = g_get_monotonic_time ();
+    send_request (request, upstream->addr);
+  }
+}
+
+/*
+ * Count a request about to be resent at upstream, the server it goes to,
+ * so that the in-flight and zone limits of that server apply to it.
+ * Returns FALSE if upstream is at its limits, the request then stays
+ * counted where it was and is tried again on the next tick.
+ */
+static gboolean move_request (ResolverRequest *request,
+                              ResolverUpstream *upstream)
+{
+  ResolverZone *zone;
+
+  if (request->upstream == upstream)
+    return take_token (upstream);
+  zone = get_zone (upstream, request->name);
+  if (upstream->in_flight >= maxInFlight
+      || zone->in_flight >= MAX (maxInFlight / 2, 1)
+      || !take_token (upstream))
+  {
+    release_zone (upstream, zone);
+    return FALSE;
+  }
+
+  /*
+   * The slot freed at the old upstream is used by the dispatch at the
+   * end of the tick.
+   */
+  detach_request (request);
+  request->upstream = upstream;
+  request->zone = zone;
+  upstream->in_flight += 1;
+  zone->in_flight += 1;
+  return TRUE;
+}
+
+static gboolean socket_event (GIOChannel *channel, GIOCondition cond,
+                              gpointer data)
+{
+  guchar             buf[DNS_MAX_PACKET];
+  struct sockaddr_in from;
+  socklen_t          fromlen;
+  ResolverRequest    *request;
+  gssize             n;
+  gint64             now;
+  guint16            id;
+
+  for (;;)
+  {
+    fromlen = sizeof (from);
+    n = recvfrom (socketFd, buf, sizeof (buf), 0,
+                  (struct sockaddr *) &from, &fromlen);
+    if (n < 0)
+      break;
+    if (n < DNS_HEADER_SIZE)
+      continue;
+
+    id = (buf[0] << 8) | buf[1];
+    now = g_get_monotonic_time ();
+    request = g_hash_table_lookup (requestIds, GUINT_TO_POINTER (id));
+    if (!request || !request->started || request->tcp
+        || !is_server (&from, request)
+        || !parse_answer (buf, n, request, now))
+      continue;
+    request_answered (request, from.sin_addr, now);
+
+    /*
+     * Too big for UDP, ask the same server again over TCP.
+     */
+    if (request->truncated)
+    {
+      debug("Answer for %s truncated, retrying over TCP\n", request->name);
+      request->tcp = TRUE;
+      request->truncated = FALSE;
+      request->attempts -= 1;
+      send_request (request, from.sin_addr);
+      continue;
+    }
+    complete_request (request, now);
+  }
+  return TRUE;
+}
+
+/*
+ * Time out and resend requests on the wire, and send queued ones as
+ * tokens come back.  Runs while there are any.
+ */
+static gboolean tick (gpointer data)
+{
+  GHashTableIter   iter;
+  ResolverRequest  *request;
+  ResolverUpstream *upstream;
+  GSList           *timed_out = NULL;
+  GSList           *list;
+  gint64           now;
+
+  now = g_get_monotonic_time ();
+  g_hash_table_iter_init (&iter, requests);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &request))
+  {
+    if (request->no_id)
+    {
+      timed_out = g_slist_prepend (timed_out, request);
+      continue;
+    }
+    if (!request->started)
+      continue;
+    if (now - request->started >= (gint64) lookupTimeout * 1000)
+    {
+      request_failed (request, now);
+      request->status = RESOLVE_TIMEOUT;
+      timed_out = g_slist_prepend (timed_out, request);
+    }
+    else if (request->attempts < RESOLVER_ATTEMPTS && !request->connection
+             && (request->tcp || now - request->sent >= (gint64) lookupTimeout * 1000 / RESOLVER_ATTEMPTS))
+    {
+      /*
+       * The resend goes to the fastest other server, if that one is under
+       * its limits.  Over TCP a query is only sent again when its
+       * connection was lost.
+       */
+      request_failed (request, now);
+      upstream = pick_upstream (request->set, request->sent_to, now);
+      if (move_request (request, upstream))
+      {
+        upstream->sent += 1;
+        send_request (request, upstream->addr);
+      }
+    }
+  }
+
+  /*
+   * Callbacks may start or cancel other lookups, so they are only run
+   * once the table is no longer being walked, and once every request
+   * that timed out or found no free id is off the wire: a lookup started
+   * by a callback must not join a request that has failed but whose
+   * callbacks haven't run yet.
+   * Dropped requests are marked completing, so cancelling their waiters
+   * doesn't free them.
+   */
+  for (list = timed_out; list; list = list->next)
+    drop_request ((ResolverRequest *) list->data);
+  while (timed_out)
+  {
+    finish_request ((ResolverRequest *) timed_out->data, now);
+    timed_out = g_slist_delete_link (timed_out, timed_out);
+  }
+
+  if (upstreams)
+  {
+    g_hash_table_iter_init (&iter, upstreams);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &upstream))
+      dispatch (upstream);
+  }
+
+  if (g_hash_table_size (requests) == 0)
+  {
+    tickTimeout = 0;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static gboolean open_socket ()
+{
+  struct sockaddr_in addr;
+  GIOChannel *channel;
+
+  if (socketFd >= 0)
+    return TRUE;
+
+  socketFd = socket (AF_INET, SOCK_DGRAM, 0);
+  if (socketFd < 0)
+    return FALSE;
+  fcntl (socketFd, F_SETFL, fcntl (socketFd, F_GETFL) | O_NONBLOCK);
+  fcntl (socketFd, F_SETFD, FD_CLOEXEC);
+
+  /*
+   * Let the kernel pick a random source port.
+   */
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  bind (socketFd, (struct sockaddr *) &addr, sizeof (addr));
+
+  channel = g_io_channel_unix_new (socketFd);
+  socketWatch = g_io_add_watch (channel, G_IO_IN, socket_event, NULL);
+  g_io_channel_unref (channel);
+  return TRUE;
+}
+
+/*
+ * Put a request for name on the wire, queued at the upstream it counts
+ * against and sent right away if the limits allow.  Returns NULL if the
+ * name can't be asked.
+ */
+static ResolverRequest *start_request (const gchar *name, ResolverSet *set)
+{
+  ResolverRequest  *request;
+  ResolverUpstream *upstream;
+  struct in_addr   none = { 0 };
+
+  if (!requestIds)
+  {
+    requestIds = g_hash_table_new (g_direct_hash, g_direct_equal);
+    requests = g_hash_table_new (g_str_hash, g_str_equal);
+  }
+
+  request = g_new0 (ResolverRequest, 1);
+  request->name = g_strdup (name);
+  request->key = request_key (set, name);
+  request->set = set;
+  request->wait_link.data = request;
+  if (!build_query (request) || !open_socket ())
+  {
+    free_request (request);
+    return NULL;
+  }
+  g_hash_table_insert (requests, request->key, request);
+
+  upstream = pick_upstream (set, none, g_get_monotonic_time ());
+  request->upstream = upstream;
+  request->zone = get_zone (upstream, request->name);
+  if (g_queue_is_empty (&request->zone->waiting))
+    g_queue_push_tail_link (&upstream->ready, &request->zone->ready_link);
+  g_queue_push_tail_link (&request->zone->waiting, &request->wait_link);
+  upstream->queued += 1;
+  dispatch (upstream);
+  if (!request->started)
+  {
+    upstream->throttled += 1;
+    upstream->max_queued = MAX (upstream->max_queued, upstream->queued);
+  }
+
+  if (!tickTimeout)
+    tickTimeout = g_timeout_add (RESOLVER_TICK, tick, NULL);
+  return request;
+}
+
+/*
+ * Carry on with a lookup from the end of its chain so far: follow the
+ * cached links, and complete it with a cached answer or wait for the
+ * request for the first name the cache doesn't know.
+ */
+static void resolve (ResolverQuery *query, gint64 now, gboolean later)
+{
+  ResolverEntry   *entry;
+  ResolverRequest *request;
+  const gchar     *current;
+  gchar           *key;
+
+  for (;;)
+  {
+    current = query->chain_len ? query->chain[query->chain_len - 1]
+                               : query->name;
+    entry = cache_get (query->set, current, now);
+    if (!entry)
+      break;
+    if (!entry->target)
+    {
+      if (later)
+        cacheStats.hits += 1;
+      query->status = entry->status;
+      query->n_addrs = entry->n_addrs;
+      memcpy (query->addrs, entry->addrs, sizeof (query->addrs));
+      finish_query (query, later);
+      return;
+    }
+    if (query->chain_len == RESOLVER_MAX_CHAIN)
+    {
+      debug("CNAME chain of %s is too long\n", query->name);
+      query->status = RESOLVE_FAILED;
+      finish_query (query, later);
+      return;
+    }
+    query->chain[query->chain_len++] = g_strdup (entry->target);
+  }
+
+  key = request_key (query->set, current);
+  request = requests ? g_hash_table_lookup (requests, key) : NULL;
+  g_free (key);
+  if (request)
+  {
+    cacheStats.coalesced += 1;
+  }
+  else
+  {
+    cacheStats.misses += 1;
+    request = start_request (current, query->set);
+    if (!request)
+    {
+      query->status = RESOLVE_FAILED;
+      finish_query (query, later);
+      return;
+    }
+  }
+  query->request = request;
+  g_queue_push_tail (&request->waiters, query);
+}
+
+void resolver_set_timeout (gint timeout_ms)
+{
+  lookupTimeout = MAX (timeout_ms, 100);
+}
+
+void resolver_set_tcp (gint connections)
+{
+  tcpConnections = MAX (connections, 0);
+}
+
+void resolver_set_limits (gint max_in_flight, gint rate, gint burst)
+{
+  maxInFlight = MAX (max_in_flight, 1);
+  rateLimit = MAX (rate, 1);
+  burstLimit = MAX (burst, 1);
+}
+
+gint resolver_get_stats (ResolverStats *stats, gint max)
+{
+  GHashTableIter   iter;
+  ResolverUpstream *upstream;
+  gint             n = 0;
+
+  if (!upstreams)
+    return 0;
+  g_hash_table_iter_init (&iter, upstreams);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &upstream))
+  {
+    if (n < max)
+    {
+      refill_tokens (upstream);
+      stats[n].server = upstream->addr;
+      stats[n].in_flight = upstream->in_flight;
+      stats[n].queued = upstream->queued;
+      stats[n].max_queued = upstream->max_queued;
+      stats[n].tokens = upstream->tokens;
+      stats[n].sent = upstream->sent;
+      stats[n].throttled = upstream->throttled;
+      stats[n].connections = upstream->connections.length;
+      stats[n].srtt_ms = upstream->srtt / 1000.0;
+      stats[n].failures = upstream->failures;
+      stats[n].demoted = upstream->demoted > g_get_monotonic_time ();
+      stats[n].answers = upstream->answers;
+      stats[n].timeouts = upstream->timeouts;
+    }
+    n += 1;
+  }
+  return n;
+}
+
+void resolver_get_cache_stats (ResolverCacheStats *stats)
+{
+  *stats = cacheStats;
+  stats->entries = cache ? g_hash_table_size (cache) : 0;
+}
+
+ResolverQuery *resolver_lookup (const gchar *name, const gchar *servers,
+                                ResolverCallback callback, gpointer data)
+{
+  ResolverQuery *query;
+  gint64        now;
+
+  if (!queries)
+    queries = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  now = g_get_monotonic_time ();
+  cache_sweep (now);
+
+  query = g_new0 (ResolverQuery, 1);
+  query->name = g_strdup (name);
+  if (g_str_has_suffix (query->name, "."))
+    query->name[strlen (query->name) - 1] = '\0';
+  query->callback = callback;
+  query->data = data;
+  query->started = now;
+  query->set = get_set (servers);
+  g_hash_table_insert (queries, query, query);
+
+  if (!query->set)
+  {
+    query->status = RESOLVE_FAILED;
+    finish_query (query, TRUE);
+    return query;
+  }
+  resolve (query, now, TRUE);
+  return query;
+}
+
+void resolver_cancel (ResolverQuery *query)
+{
+  ResolverRequest  *request = query->request;
+  ResolverUpstream *upstream;
+
+  debug("Lookup %s cancelled\n", query->name);
+  g_hash_table_remove (queries, query);
+  g_queue_remove (&done, query);
+  if (request)
+  {
+    g_queue_remove (&request->waiters, query);
+
+    /*
+     * Nobody else is waiting for the answer, stop asking.
+     */
+    if (g_queue_is_empty (&request->waiters) && !request->completing)
+    {
+      upstream = request->upstream;
+      drop_request (request);
+      free_request (request);
+      if (upstream)
+        dispatch (upstream);
+    }
+  }
+  free_query (query);
+}
+
+gint resolver_pending ()
+{
+  return queries ? g_hash_table_size (queries) : 0;
+}
+
+void resolver_shutdown ()
+{
+  GHashTableIter   iter;
+  ResolverQuery    *query;
+  ResolverRequest  *request;
+  ResolverUpstream *upstream;
+
+  if (queries)
+  {
+    g_hash_table_iter_init (&iter, queries);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &query))
+    {
+      g_hash_table_iter_remove (&iter);
+      free_query (query);
+    }
+  }
+  g_queue_clear (&done);
+  if (requests)
+  {
+    g_hash_table_iter_init (&iter, requests);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &request))
+    {
+      g_hash_table_iter_remove (&iter);
+      if (request->id)
+        g_hash_table_remove (requestIds, GUINT_TO_POINTER (request->id));
+      detach_request (request);
+      g_queue_clear (&request->waiters);
+      free_request (request);
+    }
+  }
+  if (doneIdle)
+  {
+    g_source_remove (doneIdle);
+    doneIdle = 0;
+  }
+  if (tickTimeout)
+  {
+    g_source_remove (tickTimeout);
+    tickTimeout = 0;
+  }
+  if (socketFd >= 0)
+  {
+    g_source_remove (socketWatch);
+    close (socketFd);
+    socketFd = -1;
+  }
+  if (upstreams)
+  {
+    /* Zones went with the requests */
+    g_hash_table_iter_init (&iter, upstreams);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &upstream))
+    {
+      while (!g_queue_is_empty (&upstream->connections))
+        free_connection (g_queue_peek_head (&upstream->connections));
+      g_hash_table_destroy (upstream->zones);
+      g_free (upstream);
+    }
+    g_hash_table_destroy (upstreams);
+    upstreams = NULL;
+  }
+  if (cache)
+  {
+    g_hash_table_destroy (cache);
+    cache = NULL;
+  }
+
+  /*
+   * resolv.conf is read again on the next lookup.
+   */
+  if (sets)
+  {
+    g_hash_table_destroy (sets);
+    sets = NULL;
+  }
+}
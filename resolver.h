@@ -0,0 +1,157 @@
+/*
+ *  Domain_check:
+ *  Non blocking DNS lookups driven from the GLib main loop.
+ *
+ *  Copyright (C) 2016 Tommy Skagemo-Andreassen
+ *
+ *  This program is free software which I release under the GNU General Public
+ *  License. You may redistribute and/or modify this program under the terms
+ *  of that license as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <glib.h>
+#include <netinet/in.h>
+
+#define RESOLVER_MAX_ADDRS 8
+#define RESOLVER_MAX_CHAIN 8
+
+/*
+ * Result of a lookup.
+ */
+enum
+{
+  RESOLVE_OK = 0,
+  RESOLVE_NXDOMAIN,     /* Name does not exist */
+  RESOLVE_NODATA,       /* Name exists, but has no A record */
+  RESOLVE_FAILED,       /* Server failure or unusable answer */
+  RESOLVE_TIMEOUT       /* No answer within the lookup timeout */
+};
+
+typedef struct _ResolverQuery ResolverQuery;
+typedef struct _ResolverRequest ResolverRequest;
+typedef struct _ResolverSet ResolverSet;
+
+typedef void (*ResolverCallback) (ResolverQuery *query, gpointer data);
+
+struct _ResolverQuery
+{
+  gchar   *name;
+  gint    status;
+  guint32 addrs[RESOLVER_MAX_ADDRS];  /* Network byte order */
+  gint    n_addrs;
+  gint    latency_ms;
+  gchar   *chain[RESOLVER_MAX_CHAIN];   /* CNAME targets followed, in order */
+  gint    chain_len;
+
+  /* Private */
+  ResolverCallback  callback;
+  gpointer          data;
+  ResolverSet       *set;           /* Servers it may be asked at */
+  gint64            started;
+  ResolverRequest   *request;       /* Request it waits for, if any */
+};
+
+/*
+ * Counters of one upstream server, for the stats.
+ */
+typedef struct
+{
+  struct in_addr server;
+  gint    in_flight;
+  gint    queued;
+  gint    max_queued;       /* Deepest the queue has been */
+  gdouble tokens;
+  guint64 sent;
+  guint64 throttled;        /* Queries that had to wait in the queue */
+  gint    connections;      /* Open TCP connections */
+  gdouble srtt_ms;          /* Smoothed round trip time, 0 until known */
+  gint    failures;         /* Timeouts since the last answer */
+  gboolean demoted;         /* Left alone after timing out repeatedly */
+  guint64 answers;
+  guint64 timeouts;         /* Queries it left unanswered */
+} ResolverStats;
+
+/*
+ * Cache and deduplication counters.
+ */
+typedef struct
+{
+  gint    entries;
+  guint64 hits;             /* Lookups answered from the cache alone */
+  guint64 misses;           /* Names that had to be asked */
+  guint64 coalesced;        /* Lookups that joined a request already asked */
+} ResolverCacheStats;
+
+/*
+ * Per-lookup timeout in ms.  A query is sent again to the next server
+ * halfway through, and completes with RESOLVE_TIMEOUT when it runs out.
+ */
+void resolver_set_timeout (gint timeout_ms);
+
+/*
+ * Limits applied to each upstream server: at most max_in_flight queries
+ * waiting for an answer, sent at no more than rate per second on average
+ * with bursts of up to burst queries.  Queries over the limits wait in a
+ * queue per zone, and the zones take turns so that a zone with many or
+ * slow names can't hold up the others.
+ */
+void resolver_set_limits (gint max_in_flight, gint rate, gint burst);
+
+/*
+ * Send queries over TCP, pipelined on up to connections connections
+ * per upstream server, or over UDP when connections is 0.
+ */
+void resolver_set_tcp (gint connections);
+
+/*
+ * Fill stats for up to max upstream servers, returns how many there are.
+ */
+gint resolver_get_stats (ResolverStats *stats, gint max);
+
+void resolver_get_cache_stats (ResolverCacheStats *stats);
+
+/*
+ * Ask the space separated addresses of servers instead of the nameservers
+ * in /etc/resolv.conf, or those again when servers is NULL.
+ */
+void resolver_set_servers (const gchar *servers);
+
+/*
+ * Read /etc/resolv.conf again if it was changed since it was last read.
+ */
+void resolver_reload (void);
+
+/*
+ * Start looking up the A records of name, at the servers in
+ * /etc/resolv.conf or at the space separated addresses of servers when
+ * it is not NULL, whichever of them answers fastest.  The name is asked
+ * as given, /etc/hosts and the search list are not used.  CNAMEs are
+ * followed, and the names followed are left in chain.  The callback is
+ * called once from the main loop when the lookup completes, unless it is
+ * cancelled first.  The query is freed when the callback returns.
+ */
+ResolverQuery *resolver_lookup (const gchar *name, const gchar *servers,
+                                ResolverCallback callback, gpointer data);
+
+/*
+ * Drop a query that has not completed yet, its callback is not called.
+ */
+void resolver_cancel (ResolverQuery *query);
+
+gint resolver_pending (void);
+
+/*
+ * Cancel every pending query and close the socket.
+ */
+void resolver_shutdown (void);
+
+#endif